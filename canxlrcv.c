@@ -20,6 +20,9 @@
 #include <linux/can/raw.h>
 
 #include "printframe.h"
+#include "capture.h"
+#include "packetring.h"
+#include "transport.h"
 
 #define ANYDEV "any"
 
@@ -30,9 +33,17 @@ void print_usage(char *prg)
 	fprintf(stderr, "%s - CAN XL frame receiver\n\n", prg);
 	fprintf(stderr, "Usage: %s [options] <CAN interface>\n", prg);
 	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "         -P (check data pattern)\n");
+	fprintf(stderr, "         -P        (check data pattern)\n");
+	fprintf(stderr, "         -w <file> (write CAN XL frames into "
+		"capture file)\n");
+	fprintf(stderr, "         -k        (receive via a memory-mapped "
+		"AF_PACKET ring)\n");
+	fprintf(stderr, "         -y        (busy-poll the socket/ring "
+		"instead of waiting)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Use interface name '%s' to receive from all CAN interfaces.\n", ANYDEV);
+	fprintf(stderr, "With -k the frames sent by the AF_PACKET TX rings "
+		"of sdt2mpdu/mpdu2sdt\n(option -k) are visible too.\n");
 }
 
 int main(int argc, char **argv)
@@ -46,20 +57,43 @@ int main(int argc, char **argv)
 	int nbytes, ret, i;
 	int sockopt = 1;
 	int check_pattern = 0;
+	FILE *outfile = NULL;
 	struct timeval tv;
 	union {
 		struct can_frame cc;
 		struct canfd_frame fd;
 		struct canxl_frame xl;
-	} can;
+	} can, *cu = &can;
 
-	while ((opt = getopt(argc, argv, "Ph?")) != -1) {
+	/* memory-mapped reception */
+	int use_packet = 0;
+	struct pring ring;
+	struct tpacket3_hdr *pkt;
+	__u64 tstamp;
+	__u32 drops;
+	int busy_poll = 0;
+
+	while ((opt = getopt(argc, argv, "Pw:kyh?")) != -1) {
 		switch (opt) {
 
 		case 'P':
 			check_pattern = 1;
 			break;
 
+		case 'w':
+			outfile = capture_create(optarg);
+			if (!outfile)
+				return 1;
+			break;
+
+		case 'k':
+			use_packet = 1;
+			break;
+
+		case 'y':
+			busy_poll = 1;
+			break;
+
 		case '?':
 		case 'h':
 		default:
@@ -79,48 +113,102 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (s < 0) {
-		perror("socket");
-		return 1;
-	}
+	if (use_packet) {
+		if (strcmp(argv[optind], ANYDEV) != 0) {
+			ifindex = if_nametoindex(argv[optind]);
+			if (!ifindex) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
 
-	ret = setsockopt(s, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
-			 &sockopt, sizeof(sockopt));
-	if (ret < 0) {
-		perror("sockopt CAN_RAW_XL_FRAMES");
-		return 1;
-	}
+		/* only CAN interfaces - also for the 'any' device */
+		if (pring_open(&ring, PRING_RX_BLOCKS, 0) < 0 ||
+		    pring_filter(&ring, 0, NULL, 0) < 0 ||
+		    pring_bind(&ring, ifindex) < 0)
+			return 1;
 
-	if (strcmp(argv[optind], ANYDEV) != 0) {
-		strcpy(ifr.ifr_name, argv[optind]);
-		ioctl(s, SIOCGIFINDEX, &ifr);
-		ifindex = ifr.ifr_ifindex;
-	}
+		s = ring.s;
+	} else {
+		s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (s < 0) {
+			perror("socket");
+			return 1;
+		}
 
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = ifindex;
+		ret = setsockopt(s, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
+				 &sockopt, sizeof(sockopt));
+		if (ret < 0) {
+			perror("sockopt CAN_RAW_XL_FRAMES");
+			return 1;
+		}
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+		if (strcmp(argv[optind], ANYDEV) != 0) {
+			strcpy(ifr.ifr_name, argv[optind]);
+			ioctl(s, SIOCGIFINDEX, &ifr);
+			ifindex = ifr.ifr_ifindex;
+		}
+
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = ifindex;
+
+		if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			return 1;
+		}
 	}
 
+	if (busy_poll)
+		transport_busy_poll(s, argv[optind]);
+
 	while (1) {
 		socklen_t len = sizeof(addr);
 
-		nbytes = recvfrom(s, &can.xl, sizeof(struct canxl_frame),
-				  0, (struct sockaddr*)&addr, &len);
-		if (nbytes < 0) {
-			perror("read");
-			return 1;
-		}
-		
-		if (ioctl(s, SIOCGSTAMP, &tv) < 0) {
-			perror("SIOCGSTAMP");
-			return 1;
-		} else {
+		if (use_packet) {
+			/* parse the frames in place in the ring */
+			pkt = pring_rx_next(&ring);
+			if (!pkt) {
+				drops = pring_drops(&ring);
+				if (drops)
+					fprintf(stderr, "%u frames dropped (ring "
+						"overflow)\n", drops);
+
+				/* the ring is checked without syscalls */
+				if (busy_poll)
+					continue;
+
+				if (pring_rx_wait(&ring) < 0) {
+					perror("poll");
+					return 1;
+				}
+				continue;
+			}
+
+			cu = pring_data(pkt);
+			nbytes = pkt->tp_snaplen;
+			addr.can_ifindex = pring_addr(pkt)->sll_ifindex;
+			tstamp = pring_tstamp(pkt);
+			tv.tv_sec = tstamp / 1000000000ULL;
+			tv.tv_usec = (tstamp % 1000000000ULL) / 1000;
 			printf("(%ld.%06ld) ", tv.tv_sec, tv.tv_usec);
+		} else {
+			nbytes = recvfrom(s, &can.xl, sizeof(struct canxl_frame),
+					  busy_poll ? MSG_DONTWAIT : 0,
+					  (struct sockaddr*)&addr, &len);
+			if (nbytes < 0 && busy_poll && errno == EAGAIN)
+				continue;
+
+			if (nbytes < 0) {
+				perror("read");
+				return 1;
+			}
+
+			if (ioctl(s, SIOCGSTAMP, &tv) < 0) {
+				perror("SIOCGSTAMP");
+				return 1;
+			} else {
+				printf("(%ld.%06ld) ", tv.tv_sec, tv.tv_usec);
+			}
 		}
 
 		ifr.ifr_ifindex = addr.can_ifindex;
@@ -138,33 +226,40 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
-		if (can.xl.flags & CANXL_XLF) {
-			if (nbytes != CANXL_HDR_SIZE + can.xl.len) {
+		if (cu->xl.flags & CANXL_XLF) {
+			if (nbytes != CANXL_HDR_SIZE + cu->xl.len) {
 				printf("nbytes = %d\n", nbytes);
 				fprintf(stderr, "read: no CAN XL frame\n");
 				return 1;
 			}
 
 			if (check_pattern) {
-				for (i = 0; i < can.xl.len; i++) {
-					if (can.xl.data[i] != ((can.xl.len + i) & 0xFFU)) {
+				for (i = 0; i < cu->xl.len; i++) {
+					if (cu->xl.data[i] != ((cu->xl.len + i) & 0xFFU)) {
 						fprintf(stderr, "check pattern failed %02X %04X\n",
-							can.xl.data[i], can.xl.len + i);
+							cu->xl.data[i], cu->xl.len + i);
 						return 1;
 					}
 				}
 			}
-			printxlframe(&can.xl);
+			printxlframe(&cu->xl);
+
+			if (outfile) {
+				if (capture_write(outfile, tv.tv_sec * 1000000000ULL +
+						  tv.tv_usec * 1000ULL, &cu->xl) < 0)
+					return 1;
+				fflush(outfile);
+			}
 			continue;
 		}
 
 		if (nbytes == CANFD_MTU) {
-			printfdframe(&can.fd);
+			printfdframe(&cu->fd);
 			continue;
 		}
 
 		if (nbytes == CAN_MTU) {
-			printccframe(&can.cc);
+			printccframe(&cu->cc);
 			continue;
 		}
 
@@ -172,7 +267,10 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	close(s);
+	if (use_packet)
+		pring_close(&ring);
+	else
+		close(s);
 
 	return 0;
 }
@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * capture.h - binary capture files of CAN XL frames with timestamps
+ *
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+#include <linux/can.h>
+
+#define CAPTURE_MAGIC 0x43584C31 /* "CXL1" */
+#define CAPTURE_VERSION 1
+
+/* 8 byte alignment of the records */
+#define CAPTURE_ALIGN(x) (((x) + 7) & ~7UL)
+
+/*
+ * A capture file starts with a struct capture_file_hdr and contains
+ * records with a struct capture_rec followed by the CAN XL frame
+ * (CAN XL header and data) that is zero padded to the next record.
+ * All values are in host byte order.
+ */
+struct capture_file_hdr {
+	__u32 magic;
+	__u32 version;
+};
+
+struct capture_rec {
+	__u64 tstamp; /* CLOCK_REALTIME in ns */
+	__u32 size; /* CAN XL frame size (CANXL_HDR_SIZE + data length) */
+	__u32 res;
+};
+
+/* memory mapped capture file for reading */
+struct capture {
+	__u8 *map;
+	size_t size;
+	size_t pos;
+};
+
+static inline int capture_open(struct capture *cap, const char *path)
+{
+	struct capture_file_hdr *fh;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size < sizeof(*fh)) {
+		fprintf(stderr, "%s: no capture file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	cap->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cap->map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	fh = (struct capture_file_hdr *)cap->map;
+	if (fh->magic != CAPTURE_MAGIC || fh->version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: no capture file\n", path);
+		munmap(cap->map, st.st_size);
+		return -1;
+	}
+
+	madvise(cap->map, st.st_size, MADV_SEQUENTIAL);
+
+	cap->size = st.st_size;
+	cap->pos = sizeof(*fh);
+
+	return 0;
+}
+
+/* check the next record and return its timestamp (ULLONG_MAX = end) */
+static inline __u64 capture_tstamp(struct capture *cap)
+{
+	struct capture_rec *rec = (struct capture_rec *)&cap->map[cap->pos];
+	struct canxl_frame *cfx = (struct canxl_frame *)(rec + 1);
+
+	if (cap->pos + sizeof(*rec) + CANXL_HDR_SIZE > cap->size)
+		return ULLONG_MAX;
+
+	if (rec->size < CANXL_HDR_SIZE + CANXL_MIN_DLEN ||
+	    rec->size > CANXL_MTU ||
+	    cap->pos + sizeof(*rec) + rec->size > cap->size ||
+	    !(cfx->flags & CANXL_XLF) ||
+	    rec->size != CANXL_HDR_SIZE + cfx->len) {
+		fprintf(stderr, "capture: invalid record at offset %zu\n",
+			cap->pos);
+		return ULLONG_MAX;
+	}
+
+	return rec->tstamp;
+}
+
+/* get the CAN XL frame of the next record (zero-copy) */
+static inline struct canxl_frame *capture_next(struct capture *cap,
+					       __u64 *tstamp)
+{
+	struct capture_rec *rec = (struct capture_rec *)&cap->map[cap->pos];
+
+	*tstamp = capture_tstamp(cap);
+	if (*tstamp == ULLONG_MAX)
+		return NULL;
+
+	cap->pos += CAPTURE_ALIGN(sizeof(*rec) + rec->size);
+
+	return (struct canxl_frame *)(rec + 1);
+}
+
+static inline void capture_close(struct capture *cap)
+{
+	munmap(cap->map, cap->size);
+}
+
+/* create a capture file for writing (buffered stream) */
+static inline FILE *capture_create(const char *path)
+{
+	struct capture_file_hdr fh = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+	};
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+	if (fwrite(&fh, sizeof(fh), 1, f) != 1) {
+		perror("capture write");
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+static inline int capture_write(FILE *f, __u64 tstamp,
+				struct canxl_frame *cfx)
+{
+	static const __u8 pad[8];
+	struct capture_rec rec = {
+		.tstamp = tstamp,
+		.size = CANXL_HDR_SIZE + cfx->len,
+	};
+	size_t padsz = CAPTURE_ALIGN(sizeof(rec) + rec.size) -
+		(sizeof(rec) + rec.size);
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+	    fwrite(cfx, rec.size, 1, f) != 1 ||
+	    (padsz && fwrite(pad, padsz, 1, f) != 1)) {
+		perror("capture write");
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif /* CAPTURE_H */
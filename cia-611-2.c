@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * cia-611-2.c - CAN CiA 611-2 M-PDU codec (libcia6112)
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h> /* for network byte order conversion */
+
+#include <linux/can.h>
+#include "cia-611-2.h"
+
+void mpdu_init(struct mpdu_builder *mb, __u8 *data, unsigned int size)
+{
+	mb->data = data;
+	mb->size = size;
+	mb->len = 0;
+	mb->ncpdus = 0;
+}
+
+/* does a C-PDU with the given data length fit into the M-PDU space? */
+int mpdu_fits(const struct mpdu_builder *mb, unsigned int c_dlen)
+{
+	return C_PDU_HEADER_SIZE + cpdu_padsz(c_dlen) <= mb->size - mb->len;
+}
+
+/* max. C-PDU data length that fits into the remaining M-PDU space */
+unsigned int mpdu_space(const struct mpdu_builder *mb)
+{
+	if (mb->size - mb->len <= C_PDU_HEADER_SIZE)
+		return 0;
+
+	return mb->size - mb->len - C_PDU_HEADER_SIZE;
+}
+
+/* position of the next C-PDU data to receive it in place */
+__u8 *mpdu_cpdu_data(const struct mpdu_builder *mb)
+{
+	return &mb->data[mb->len + C_PDU_HEADER_SIZE];
+}
+
+/*
+ * Append a C-PDU to the M-PDU. The data is not copied when it has been
+ * placed at mpdu_cpdu_data() before.
+ */
+int mpdu_append(struct mpdu_builder *mb, const struct cpdu *c)
+{
+	struct c_pdu_header *c_pdu_hdr;
+	__u8 *data;
+
+	/* we have at least one data byte in a CAN XL frame */
+	if (c->c_dlen < 1 || c->c_dlen > CANXL_MAX_DLEN)
+		return -ERANGE;
+
+	if (!mpdu_fits(mb, c->c_dlen))
+		return -ENOSPC;
+
+	c_pdu_hdr = (struct c_pdu_header *) &mb->data[mb->len];
+	c_pdu_hdr->c_type = c->c_type;
+	c_pdu_hdr->c_info = c->c_info;
+	c_pdu_hdr->c_dlen = htons(c->c_dlen);
+	c_pdu_hdr->c_id = htonl(c->c_id);
+
+	data = mpdu_cpdu_data(mb);
+	if (c->data != data)
+		memcpy(data, c->data, c->c_dlen);
+
+	/* zero the padding bytes */
+	memset(&data[c->c_dlen], 0, cpdu_padsz(c->c_dlen) - c->c_dlen);
+
+	mb->len += C_PDU_HEADER_SIZE + cpdu_padsz(c->c_dlen);
+	mb->ncpdus++;
+
+	return 0;
+}
+
+int mpdu_iter_init(struct mpdu_iter *it, __u8 *data, unsigned int len)
+{
+	/* size must be a padded length value */
+	if (len % 4)
+		return -EINVAL;
+
+	/* size must be at least one C-PDU header and a padded byte */
+	if (len < MPDU_MIN_SIZE)
+		return -ENODATA;
+
+	it->data = data;
+	it->len = len;
+	it->pos = 0;
+
+	return 0;
+}
+
+/*
+ * Get the next C-PDU of the M-PDU. Returns 1 for a valid C-PDU, 0 at the
+ * end of the M-PDU or a negative error code. The C-PDU data is not copied.
+ */
+int mpdu_iter_next(struct mpdu_iter *it, struct cpdu *c)
+{
+	struct c_pdu_header *c_pdu_hdr;
+	unsigned int padsz;
+
+	/* check for minimum length of C-PDU */
+	if (it->pos > it->len - MPDU_MIN_SIZE)
+		return 0;
+
+	c_pdu_hdr = (struct c_pdu_header *) &it->data[it->pos];
+
+	c->c_dlen = ntohs(c_pdu_hdr->c_dlen); /* get real data length */
+
+	/* zero length marks the padding up to the end of the M-PDU */
+	if (c->c_dlen < 1)
+		return 0;
+
+	padsz = cpdu_padsz(c->c_dlen);
+
+	/* does the C-PDU incl. data fit into the M-PDU space? */
+	if (C_PDU_HEADER_SIZE + padsz > it->len - it->pos)
+		return -EMSGSIZE;
+
+	c->c_type = c_pdu_hdr->c_type;
+	c->c_info = c_pdu_hdr->c_info;
+	c->c_id = ntohl(c_pdu_hdr->c_id);
+	c->data = &it->data[it->pos + C_PDU_HEADER_SIZE];
+
+	it->pos += C_PDU_HEADER_SIZE + padsz;
+
+	return 1;
+}
+
+const char *mpdu_strerror(int err)
+{
+	switch (err) {
+	case -ERANGE:
+		return "C-PDU data length out of range";
+	case -ENOSPC:
+		return "C-PDU does not fit into M-PDU space";
+	case -EINVAL:
+		return "M-PDU not padded correctly";
+	case -ENODATA:
+		return "M-PDU content too short";
+	case -EMSGSIZE:
+		return "C-PDU content too long";
+	default:
+		return strerror(-err);
+	}
+}
@@ -34,4 +34,67 @@ struct c_pdu_header {
 
 #define MPDU_DEFAULT_TIMEOUT_MS 1000
 
+/* max. number of C-PDU elements that fit into a M-PDU */
+#define MPDU_MAX_C_PDUS (MPDU_MAX_SIZE / MPDU_MIN_SIZE)
+
+/*
+ * CAN XL frame header (struct canxl_frame without data) to separate
+ * header and payload in scatter/gather I/O with iovecs.
+ */
+struct canxl_hdr {
+	canid_t prio;
+	__u8 flags;
+	__u8 sdt;
+	__u16 len;
+	__u32 af;
+};
+
+/*
+ * libcia6112 - M-PDU codec
+ *
+ * The C-PDU content of struct cpdu is in host byte order. The data
+ * pointer refers to the C-PDU data inside the M-PDU (zero-copy) or to
+ * the data that is appended to the M-PDU.
+ * All functions return negative error codes (see mpdu_strerror()).
+ */
+struct cpdu {
+	__u8 c_type;
+	__u8 c_info;
+	__u16 c_dlen;
+	__u32 c_id;
+	__u8 *data;
+};
+
+/* M-PDU builder: appends C-PDUs to the data section of a CAN XL frame */
+struct mpdu_builder {
+	__u8 *data;
+	unsigned int size; /* M-PDU size limit */
+	unsigned int len; /* current M-PDU length */
+	unsigned int ncpdus;
+};
+
+/* M-PDU iterator: walks through the C-PDUs of a received M-PDU */
+struct mpdu_iter {
+	__u8 *data;
+	unsigned int len;
+	unsigned int pos;
+};
+
+/* C-PDU data length rounded up to the next 4 byte boundary */
+static inline unsigned int cpdu_padsz(unsigned int c_dlen)
+{
+	return (c_dlen + 3) & ~3U;
+}
+
+void mpdu_init(struct mpdu_builder *mb, __u8 *data, unsigned int size);
+int mpdu_fits(const struct mpdu_builder *mb, unsigned int c_dlen);
+unsigned int mpdu_space(const struct mpdu_builder *mb);
+__u8 *mpdu_cpdu_data(const struct mpdu_builder *mb);
+int mpdu_append(struct mpdu_builder *mb, const struct cpdu *c);
+
+int mpdu_iter_init(struct mpdu_iter *it, __u8 *data, unsigned int len);
+int mpdu_iter_next(struct mpdu_iter *it, struct cpdu *c);
+
+const char *mpdu_strerror(int err);
+
 #endif /* CIA_611_2_H */
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * dwelltime.h - log-linear dwell time histograms per SDT
+ *
+ */
+
+#ifndef DWELLTIME_H
+#define DWELLTIME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+
+/*
+ * Each power of two range of nanoseconds is split into DWELL_SUB_BUCKETS
+ * linear sub buckets which leads to a relative resolution of 12.5%.
+ */
+#define DWELL_SUB_BITS 3
+#define DWELL_SUB_BUCKETS (1 << DWELL_SUB_BITS)
+#define DWELL_BUCKETS ((64 - DWELL_SUB_BITS + 1) * DWELL_SUB_BUCKETS)
+
+#define DWELL_TSFLAGS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+
+struct dwell_hist {
+	__u64 count;
+	__u64 sum;
+	__u64 min;
+	__u64 max;
+	__u64 bucket[DWELL_BUCKETS];
+};
+
+/* histograms are allocated on first use for each SDT */
+struct dwell_stats {
+	struct dwell_hist *sdt[256];
+};
+
+/* same clock base as the SO_TIMESTAMPING software timestamps */
+static inline __u64 dwell_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* get the software RX timestamp from a received message (0 = none) */
+static inline __u64 dwell_rxstamp(struct msghdr *msg)
+{
+	struct scm_timestamping *tss;
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_TIMESTAMPING) {
+			tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			return (__u64)tss->ts[0].tv_sec * 1000000000ULL +
+				tss->ts[0].tv_nsec;
+		}
+	}
+
+	return 0;
+}
+
+static inline unsigned int dwell_index(__u64 ns)
+{
+	unsigned int e;
+
+	if (ns < DWELL_SUB_BUCKETS)
+		return ns;
+
+	e = 63 - __builtin_clzll(ns);
+
+	return (e - DWELL_SUB_BITS + 1) * DWELL_SUB_BUCKETS +
+		((ns >> (e - DWELL_SUB_BITS)) & (DWELL_SUB_BUCKETS - 1));
+}
+
+/* lowest value of the bucket */
+static inline __u64 dwell_value(unsigned int idx)
+{
+	unsigned int e;
+
+	if (idx < DWELL_SUB_BUCKETS)
+		return idx;
+
+	e = idx / DWELL_SUB_BUCKETS + DWELL_SUB_BITS - 1;
+
+	return (__u64)(DWELL_SUB_BUCKETS + idx % DWELL_SUB_BUCKETS) <<
+		(e - DWELL_SUB_BITS);
+}
+
+static inline void dwell_hist_add(struct dwell_hist *h, __u64 ns)
+{
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->sum += ns;
+	h->bucket[dwell_index(ns)]++;
+}
+
+static inline void dwell_add(struct dwell_stats *ds, __u8 sdt, __u64 ns)
+{
+	struct dwell_hist *h = ds->sdt[sdt];
+
+	if (!h) {
+		h = calloc(1, sizeof(*h));
+		if (!h)
+			return; /* no statistics for this SDT */
+		ds->sdt[sdt] = h;
+	}
+
+	dwell_hist_add(h, ns);
+}
+
+/* value at the given percentile (lowest value of the bucket) */
+static inline __u64 dwell_percentile(struct dwell_hist *h, double pct)
+{
+	__u64 limit = h->count * pct / 100;
+	__u64 cnt = 0;
+	unsigned int i;
+
+	for (i = 0; i < DWELL_BUCKETS; i++) {
+		cnt += h->bucket[i];
+		if (cnt > limit)
+			return dwell_value(i);
+	}
+
+	return h->max;
+}
+
+static inline void dwell_dump(struct dwell_stats *ds, const char *name)
+{
+	struct dwell_hist *h;
+	unsigned int sdt, i;
+
+	for (sdt = 0; sdt < 256; sdt++) {
+		h = ds->sdt[sdt];
+		if (!h || !h->count)
+			continue;
+
+		printf("%s dwell time SDT %02X: count %llu min %.1fus "
+		       "avg %.1fus max %.1fus\n", name, sdt, h->count,
+		       h->min / 1000.0, h->sum / 1000.0 / h->count,
+		       h->max / 1000.0);
+		printf("%s dwell time SDT %02X: p50 %.1fus p90 %.1fus "
+		       "p99 %.1fus p99.9 %.1fus\n", name, sdt,
+		       dwell_percentile(h, 50) / 1000.0,
+		       dwell_percentile(h, 90) / 1000.0,
+		       dwell_percentile(h, 99) / 1000.0,
+		       dwell_percentile(h, 99.9) / 1000.0);
+
+		for (i = 0; i < DWELL_BUCKETS; i++) {
+			if (!h->bucket[i])
+				continue;
+
+			printf("  [%12.1fus .. %12.1fus) %llu\n",
+			       dwell_value(i) / 1000.0,
+			       dwell_value(i + 1) / 1000.0, h->bucket[i]);
+		}
+	}
+	fflush(stdout);
+}
+
+/*
+ * Wake-to-process latency: from the RX timestamp of the kernel to the
+ * processing of the frame in the tool (busy-poll or blocking receive).
+ */
+static inline void dwell_wake_dump(struct dwell_hist *h, const char *name,
+				   int busy_poll)
+{
+	const char *mode = busy_poll ? "busy-poll" : "blocking";
+
+	if (!h->count)
+		return;
+
+	printf("%s wake latency (%s): count %llu min %.1fus avg %.1fus "
+	       "max %.1fus\n", name, mode, h->count, h->min / 1000.0,
+	       h->sum / 1000.0 / h->count, h->max / 1000.0);
+	printf("%s wake latency (%s): p50 %.1fus p99 %.1fus p99.9 %.1fus\n",
+	       name, mode, dwell_percentile(h, 50) / 1000.0,
+	       dwell_percentile(h, 99) / 1000.0,
+	       dwell_percentile(h, 99.9) / 1000.0);
+	fflush(stdout);
+}
+
+#endif /* DWELLTIME_H */
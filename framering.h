@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * framering.h - bounded lock-free SPSC ring of preallocated CAN XL frames
+ *
+ * The producer fills and commits frame slots and wakes up the consumer
+ * with frame_ring_kick() (e.g. once per M-PDU). The consumer only sleeps
+ * in an eventfd read when the ring is empty. A producer that finds the
+ * ring full sleeps in a second eventfd read until the consumer has
+ * released slots.
+ */
+
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/types.h>
+#include <linux/can.h>
+
+struct frame_slot {
+	__u64 tstamp; /* RX timestamp of the M-PDU (0 = none) */
+	struct canxl_frame cf;
+};
+
+struct frame_ring {
+	struct frame_slot *slot;
+	unsigned int size; /* number of slots (power of 2) */
+	int efd; /* eventfd to wake up the consumer */
+	int pfd; /* eventfd to wake up the producer */
+	int stop; /* producer has finished */
+	int waiting; /* consumer sleeps in the eventfd read */
+	int pwaiting; /* producer sleeps in the eventfd read (ring full) */
+
+	/* producer and consumer index on separate cache lines */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+};
+
+static inline struct frame_ring *frame_ring_create(unsigned int size)
+{
+	struct frame_ring *r;
+
+	if (posix_memalign((void **)&r, 64, sizeof(*r)))
+		return NULL;
+
+	memset(r, 0, sizeof(*r));
+	r->size = size;
+
+	r->slot = calloc(size, sizeof(struct frame_slot));
+	if (!r->slot) {
+		free(r);
+		return NULL;
+	}
+
+	r->efd = eventfd(0, 0);
+	if (r->efd < 0) {
+		perror("eventfd");
+		free(r->slot);
+		free(r);
+		return NULL;
+	}
+
+	r->pfd = eventfd(0, 0);
+	if (r->pfd < 0) {
+		perror("eventfd");
+		close(r->efd);
+		free(r->slot);
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static inline void frame_ring_free(struct frame_ring *r)
+{
+	close(r->efd);
+	close(r->pfd);
+	free(r->slot);
+	free(r);
+}
+
+/* number of filled slots (producer view) */
+static inline unsigned int frame_ring_used(struct frame_ring *r)
+{
+	return r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer: get the next free slot - NULL when the ring is full */
+static inline struct frame_slot *frame_ring_reserve(struct frame_ring *r)
+{
+	if (frame_ring_used(r) >= r->size)
+		return NULL;
+
+	return &r->slot[r->head & (r->size - 1)];
+}
+
+/* producer: wake up the consumer if it sleeps */
+static inline void frame_ring_kick(struct frame_ring *r)
+{
+	__u64 one = 1;
+
+	if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST) &&
+	    write(r->efd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+}
+
+/* producer: hand over the filled slots and wait for a free slot */
+static inline struct frame_slot *frame_ring_reserve_wait(struct frame_ring *r)
+{
+	struct frame_slot *slot;
+	__u64 cnt;
+
+	frame_ring_kick(r);
+	while (!(slot = frame_ring_reserve(r))) {
+		/* announce the sleep and re-check to not miss a release */
+		__atomic_store_n(&r->pwaiting, 1, __ATOMIC_SEQ_CST);
+		if (frame_ring_used(r) >= r->size &&
+		    read(r->pfd, &cnt, sizeof(cnt)) < 0)
+			perror("eventfd read");
+		__atomic_store_n(&r->pwaiting, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return slot;
+}
+
+/* producer: make the reserved slot visible to the consumer */
+static inline void frame_ring_commit(struct frame_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+}
+
+/* producer: let the consumer terminate after draining the ring */
+static inline void frame_ring_stop(struct frame_ring *r)
+{
+	__u64 one = 1;
+
+	__atomic_store_n(&r->stop, 1, __ATOMIC_SEQ_CST);
+	if (write(r->efd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+}
+
+/*
+ * consumer: wait for filled slots and return the number of contiguous
+ * slots starting at *first (0 = stopped and drained)
+ */
+static inline unsigned int frame_ring_wait(struct frame_ring *r,
+					   struct frame_slot **first)
+{
+	unsigned int head, idx;
+	__u64 cnt;
+
+	while (1) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head != r->tail)
+			break;
+
+		if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+			return 0;
+
+		/* announce the sleep and re-check to not miss a kick */
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == r->tail &&
+		    !__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST) &&
+		    read(r->efd, &cnt, sizeof(cnt)) < 0)
+			perror("eventfd read");
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+	}
+
+	idx = r->tail & (r->size - 1);
+	*first = &r->slot[idx];
+
+	/* no wrap around */
+	if (head - r->tail > r->size - idx)
+		return r->size - idx;
+
+	return head - r->tail;
+}
+
+/* consumer: hand back the processed slots to the producer */
+static inline void frame_ring_release(struct frame_ring *r, unsigned int n)
+{
+	__u64 one = 1;
+
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_SEQ_CST);
+
+	/* wake up the producer that waits for free slots */
+	if (__atomic_load_n(&r->pwaiting, __ATOMIC_SEQ_CST) &&
+	    write(r->pfd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+}
+
+#endif /* FRAMERING_H */
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * metrics.h - M-PDU composer/decomposer counters in shared memory
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#define METRICS_MAGIC 0x4D504455 /* "MPDU" */
+#define METRICS_VERSION 6
+
+/* reasons for sending a composed M-PDU */
+enum {
+	METRICS_TIMEOUT,
+	METRICS_BUFFER,
+	METRICS_DEMAND,
+	METRICS_COUNT,
+	METRICS_TARGET,
+	METRICS_POOL,
+	METRICS_EXIT,
+	METRICS_REASONS
+};
+
+static inline const char *metrics_reason(int reason)
+{
+	static const char *name[METRICS_REASONS] = {
+		"timeout", "buffer", "demand", "count", "target", "pool", "exit"
+	};
+
+	return name[reason];
+}
+
+#define METRICS_FILL_BUCKETS 10 /* M-PDU fill ratio in 10% steps */
+#define METRICS_CPDU_BUCKETS 8 /* C-PDUs per M-PDU in log2 steps (1 .. 255) */
+#define METRICS_LATE_BUCKETS 16 /* timeout lateness in log2 us steps (< 1 us .. >= 16 ms) */
+
+/*
+ * The counters are only written by the tool and can be read at any time
+ * by a collector that maps the shared memory object (see mpdustat).
+ * sdt2mpdu: frames_in = C-PDUs, frames_out = M-PDUs
+ * mpdu2sdt: frames_in = M-PDUs, frames_out = C-PDUs
+ */
+struct mpdu_metrics {
+	__u32 magic;
+	__u32 version;
+	char tool[16];
+	__u64 frames_in;
+	__u64 frames_out;
+	__u64 bytes_in;
+	__u64 bytes_out;
+	__u64 mpdus[METRICS_REASONS]; /* composed M-PDUs per send reason */
+	__u64 fill[METRICS_FILL_BUCKETS]; /* composed/decomposed M-PDUs */
+	__u64 cpdus[METRICS_CPDU_BUCKETS]; /* composed/decomposed M-PDUs */
+	__u64 drop_oversize; /* PDUs exceeding the M-PDU size limit */
+	__u64 drop_no_mpdu; /* received frames that are no M-PDU */
+	__u64 drop_rxq; /* frames dropped by the kernel (SO_RXQ_OVFL) */
+	__u64 drop_invalid; /* malformed frames and M-PDUs (mpdugw) */
+	__u64 syscalls; /* syscalls for I/O, polling and timers */
+	__u64 ring_slots; /* frame ring between RX and TX thread */
+	__u64 ring_used; /* current ring occupancy */
+	__u64 ring_max; /* max. ring occupancy */
+	__u64 ring_overflow; /* RX thread waits for a full ring */
+	__u64 tx_stalls; /* destination did not take frames (EAGAIN/ENOBUFS) */
+	__u64 tx_stall_ns; /* time waiting for the destination */
+	__u64 txq_len; /* frames in the pending TX queue */
+	__u64 txq_max; /* max. frames in the pending TX queue */
+	__u64 late[METRICS_LATE_BUCKETS]; /* M-PDUs sent after their deadline */
+	__u64 late_max_ns; /* max. M-PDU timer expiry lateness */
+};
+
+/* for counters that are updated by more than one thread */
+#define METRICS_ADD(cnt, val) __atomic_fetch_add(&(cnt), (val), __ATOMIC_RELAXED)
+
+static inline void metrics_mpdu(struct mpdu_metrics *m, unsigned int len,
+				unsigned int max_len, unsigned int ncpdus)
+{
+	unsigned int fill = len * METRICS_FILL_BUCKETS / max_len;
+	unsigned int cpdus = 31 - __builtin_clz(ncpdus | 1);
+
+	if (fill >= METRICS_FILL_BUCKETS)
+		fill = METRICS_FILL_BUCKETS - 1;
+	if (cpdus >= METRICS_CPDU_BUCKETS)
+		cpdus = METRICS_CPDU_BUCKETS - 1;
+
+	m->fill[fill]++;
+	m->cpdus[cpdus]++;
+}
+
+/* lateness of the timer expiry that sent an M-PDU by its deadline */
+static inline void metrics_late(struct mpdu_metrics *m, __u64 ns)
+{
+	__u64 us = ns / 1000;
+	unsigned int late = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (late >= METRICS_LATE_BUCKETS)
+		late = METRICS_LATE_BUCKETS - 1;
+
+	m->late[late]++;
+	if (ns > m->late_max_ns)
+		m->late_max_ns = ns;
+}
+
+/* map the counters to the shared memory object /dev/shm/<name> */
+static inline struct mpdu_metrics *metrics_open(const char *name,
+						const char *tool)
+{
+	struct mpdu_metrics *m;
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/%s", name);
+
+	fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("shm_open");
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(*m)) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+
+	m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	strncpy(m->tool, tool, sizeof(m->tool) - 1);
+	m->version = METRICS_VERSION;
+	m->magic = METRICS_MAGIC;
+
+	return m;
+}
+
+#endif /* METRICS_H */
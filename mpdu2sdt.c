@@ -10,6 +10,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -22,9 +25,355 @@
 #include <linux/can/raw.h>
 #include "cia-611-2.h"
 #include "printframe.h"
+#include "dwelltime.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "transport.h"
+#include "framering.h"
+#include "txqueue.h"
+#include "uring.h"
+#include "packetring.h"
+#include "rtmode.h"
+#include "mpducore.h"
+
+#define MAX_RING_SLOTS 65536 /* max. C-PDU slots between RX and TX thread */
+#define TX_BATCH 64 /* max. C-PDUs per sendmmsg() of the TX thread */
+#define URING_RX_BUFS 256 /* provided buffers for M-PDUs (power of 2) */
+#define URING_RXQ_SIZE (URING_RX_BUFS + 1) /* received buffers + end */
+#define URING_TXQ_SIZE MPDU_MAX_C_PDUS /* C-PDUs in one chain of sends */
+
+/* io_uring request types */
+enum {
+	URING_RECV,
+	URING_SEND,
+	URING_RETRY,
+};
 
 extern int optind, opterr, optopt;
 
+/* transmit thread context */
+struct tx_ctx {
+	struct frame_ring *ring;
+	int dst;
+	FILE *outfile;
+	int file_in;
+	int use_sendmmsg;
+	int measure;
+	struct dwell_stats *dwell;
+	struct mpdu_metrics *metrics;
+};
+
+static volatile sig_atomic_t dump_request;
+
+/* io_uring I/O engine */
+static int use_uring;
+static struct uring ur;
+static struct uring_bufs uring_bufs;
+static struct msghdr uring_msg; /* layout of the provided buffers */
+static struct txq uring_txq; /* C-PDUs that wait for their send */
+static int uring_rxq[URING_RXQ_SIZE]; /* received buffers (-1 = end) */
+static unsigned int uring_rxq_head, uring_rxq_tail;
+static int uring_rearm = 1; /* multishot receive has to be (re-)armed */
+static int uring_retry; /* ENOBUFS retry timeout is pending */
+static struct __kernel_timespec uring_retry_ts = { 0, TXQ_RETRY_NS };
+static __u64 uring_stall;
+
+static void sigusr2(int signo)
+{
+	dump_request = 1;
+}
+
+/* wait for the destination after a transient send failure */
+static void tx_stall(int dst, int err, __u64 *since,
+		     struct mpdu_metrics *metrics)
+{
+	tx_stall_begin(since, dwell_now, metrics);
+	tx_wait(dst, err);
+}
+
+/* completion handling - the received buffers are only queued here */
+static void uring_reap(struct mpdu_metrics *metrics)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while ((cqe = uring_peek(&ur))) {
+		switch (URING_UD_TYPE(cqe->user_data)) {
+		case URING_RECV:
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_rearm = 1;
+
+			/* all provided buffers in use => re-armed later */
+			if (cqe->res == -ENOBUFS)
+				break;
+
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror("io_uring recvmsg");
+				exit(1);
+			}
+
+			uring_rxq[uring_rxq_head++ % URING_RXQ_SIZE] =
+				(cqe->flags & IORING_CQE_F_BUFFER) ?
+				(int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+			break;
+
+		case URING_SEND:
+			ret = uring_send_done(&ur, &uring_txq, cqe);
+			if (ret < 0) {
+				perror("write dst canxl_frame");
+				exit(1);
+			}
+
+			if (ret) {
+				metrics->frames_out++;
+				metrics->bytes_out += cqe->res;
+			} else if (cqe->res != -ECANCELED) {
+				tx_stall_begin(&uring_stall, dwell_now,
+					       metrics);
+			}
+
+			metrics->txq_len = txq_len(&uring_txq);
+			if (!metrics->txq_len)
+				tx_stall_end(&uring_stall, dwell_now, metrics);
+			break;
+
+		case URING_RETRY:
+			uring_retry = 0;
+			ur.tx_blocked = 0;
+			break;
+		}
+
+		uring_seen(&ur);
+	}
+}
+
+/* start the next chain of linked sends, submit and wait for completions */
+static void uring_wait(int dst, struct mpdu_metrics *metrics)
+{
+	struct io_uring_sqe *sqe;
+
+	/* ENOBUFS is not signalled - send the chain again after a delay */
+	if (ur.tx_blocked && !ur.tx_inflight && !uring_retry) {
+		sqe = uring_get_sqe(&ur);
+		if (sqe) {
+			uring_prep_timeout(sqe, &uring_retry_ts, 0,
+					   URING_UD(URING_RETRY, 0));
+			uring_retry = 1;
+		}
+	}
+
+	uring_send_txq(&ur, &uring_txq, dst, URING_UD(URING_SEND, 0));
+
+	if (uring_submit(&ur, 1) < 0 && errno != EINTR) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+	METRICS_ADD(metrics->syscalls, 1);
+
+	uring_reap(metrics);
+}
+
+/*
+ * Get the next received M-PDU. The frame and the control messages are
+ * copied from the provided buffer, which is handed back to the kernel
+ * right away. Returns the frame length (0 = end of the connection).
+ */
+static int uring_recv(int src, int dst, struct canxl_frame *cf,
+		      struct msghdr *msg, char *ctrl, size_t ctrlsize,
+		      struct mpdu_metrics *metrics)
+{
+	struct io_uring_sqe *sqe;
+	struct msghdr out;
+	void *payload;
+	int bid, nbytes;
+
+	while (uring_rxq_tail == uring_rxq_head) {
+		/* SIGUSR2 interrupts the wait like a blocking recvmsg() */
+		if (dump_request) {
+			errno = EINTR;
+			return -1;
+		}
+
+		if (uring_rearm && (sqe = uring_get_sqe(&ur))) {
+			uring_prep_recvmsg_multishot(sqe, src, &uring_msg, 0,
+						     URING_UD(URING_RECV, 0));
+			uring_rearm = 0;
+		}
+
+		uring_wait(dst, metrics);
+	}
+
+	bid = uring_rxq[uring_rxq_tail++ % URING_RXQ_SIZE];
+	if (bid < 0)
+		return 0;
+
+	payload = uring_recvmsg(&uring_bufs, bid, &uring_msg, &out, &nbytes);
+
+	if (out.msg_flags & MSG_TRUNC) {
+		errno = EMSGSIZE;
+		nbytes = -1;
+	} else {
+		memcpy(cf, payload, nbytes);
+	}
+
+	if (out.msg_controllen > ctrlsize)
+		out.msg_controllen = ctrlsize;
+	memcpy(ctrl, out.msg_control, out.msg_controllen);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_control = ctrl;
+	msg->msg_controllen = out.msg_controllen;
+
+	uring_bufs_put(&uring_bufs, bid);
+
+	return nbytes;
+}
+
+/* write C-PDU frame to destination capture file or socket */
+static void send_cpdu(int dst, FILE *outfile, __u64 tstamp,
+		      struct canxl_frame *cfdst, struct mpdu_metrics *metrics)
+{
+	__u64 stall = 0;
+	int ret;
+
+	if (outfile) {
+		if (capture_write(outfile, tstamp, cfdst) < 0)
+			exit(1);
+	} else if (use_uring) {
+		/* sent as a chain of linked sends when waiting for the source */
+		while (txq_full(&uring_txq))
+			uring_wait(dst, metrics);
+
+		txq_push(&uring_txq, cfdst);
+		metrics->txq_len = txq_len(&uring_txq);
+		if (metrics->txq_len > metrics->txq_max)
+			metrics->txq_max = metrics->txq_len;
+		return; /* counted on completion */
+	} else {
+		/* a full socket or CAN TX queue is no reason to give up */
+		while (!(ret = tx_frame(dst, cfdst))) {
+			METRICS_ADD(metrics->syscalls, 1);
+			tx_stall(dst, errno, &stall, metrics);
+		}
+		METRICS_ADD(metrics->syscalls, 1);
+		tx_stall_end(&stall, dwell_now, metrics);
+
+		if (ret < 0) {
+			perror("write dst canxl_frame");
+			exit(1);
+		}
+	}
+
+	metrics->frames_out++;
+	metrics->bytes_out += CANXL_HDR_SIZE + cfdst->len;
+}
+
+/* hand over the C-PDUs in the AF_PACKET TX ring to the kernel */
+static void packet_flush(struct pring *r, struct mpdu_metrics *metrics)
+{
+	__u64 stall = 0;
+	int ret;
+
+	while ((ret = pring_tx_flush(r)) < 0) {
+		METRICS_ADD(metrics->syscalls, 1);
+		if (!tx_transient(errno)) {
+			perror("packet ring send");
+			exit(1);
+		}
+		tx_stall(r->s, errno, &stall, metrics);
+	}
+	if (ret)
+		METRICS_ADD(metrics->syscalls, 1);
+	tx_stall_end(&stall, dwell_now, metrics);
+}
+
+/* free AF_PACKET TX ring slot - the kernel releases the sent frames */
+static struct canxl_frame *packet_slot(struct pring *r,
+				       struct mpdu_metrics *metrics)
+{
+	struct canxl_frame *cf;
+	__u64 stall = 0;
+
+	while (!(cf = pring_tx_get(r))) {
+		packet_flush(r, metrics);
+		METRICS_ADD(metrics->syscalls, 1);
+		tx_stall(r->s, EAGAIN, &stall, metrics);
+	}
+	tx_stall_end(&stall, dwell_now, metrics);
+
+	return cf;
+}
+
+/* transmit thread: drains the C-PDU frames from the ring */
+static void *tx_thread(void *arg)
+{
+	struct tx_ctx *tx = arg;
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iovs[TX_BATCH];
+	struct frame_slot *slot;
+	unsigned int n, i;
+	int ret;
+	__u64 now, stall;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < TX_BATCH; i++) {
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while ((n = frame_ring_wait(tx->ring, &slot))) {
+		if (n > TX_BATCH)
+			n = TX_BATCH;
+
+		if (tx->use_sendmmsg) {
+			for (i = 0; i < n; i++) {
+				iovs[i].iov_base = &slot[i].cf;
+				iovs[i].iov_len = CANXL_HDR_SIZE + slot[i].cf.len;
+			}
+
+			stall = 0;
+			while ((ret = sendmmsg(tx->dst, msgs, n,
+					       MSG_DONTWAIT)) < 0 &&
+			       tx_transient(errno)) {
+				METRICS_ADD(tx->metrics->syscalls, 1);
+				tx_stall(tx->dst, errno, &stall, tx->metrics);
+			}
+			METRICS_ADD(tx->metrics->syscalls, 1);
+			tx_stall_end(&stall, dwell_now, tx->metrics);
+
+			if (ret < 0) {
+				perror("sendmmsg dst canxl_frames");
+				exit(1);
+			}
+
+			n = ret;
+			for (i = 0; i < n; i++) {
+				tx->metrics->frames_out++;
+				tx->metrics->bytes_out += iovs[i].iov_len;
+			}
+		} else {
+			for (i = 0; i < n; i++)
+				send_cpdu(tx->dst, tx->outfile, tx->file_in ?
+					  slot[i].tstamp : dwell_now(),
+					  &slot[i].cf, tx->metrics);
+		}
+
+		if (tx->measure) {
+			now = dwell_now();
+			for (i = 0; i < n; i++)
+				if (slot[i].tstamp)
+					dwell_add(tx->dwell, slot[i].cf.sdt,
+						  now - slot[i].tstamp);
+		}
+
+		frame_ring_release(tx->ring, n);
+	}
+
+	return NULL;
+}
+
 void print_usage(char *prg)
 {
 	fprintf(stderr, "%s - CAN XL CiA 611-2 MPDU decomposer\n\n", prg);
@@ -35,7 +384,42 @@ void print_usage(char *prg)
 	fprintf(stderr, "         -l <size>        (limit PDU size"
 		" to %ld .. %d, default: %d)\n", MPDU_MIN_SIZE, MPDU_MAX_SIZE,
 		MPDU_DEFAULT_SIZE);
+	fprintf(stderr, "         -m               (send all C-PDUs of a M-PDU "
+		"with one sendmmsg() syscall)\n");
+	fprintf(stderr, "         -R <slots>       (send C-PDUs from a separate "
+		"thread via a ring of\n"
+		"                          <slots> frames - power of 2 up to "
+		"%d)\n", MAX_RING_SLOTS);
+	fprintf(stderr, "         -s <rcv>[:<snd>] (socket receive and send "
+		"buffer size in bytes)\n");
+	fprintf(stderr, "         -U               (io_uring I/O engine instead "
+		"of recvmsg() and send())\n");
+	fprintf(stderr, "         -k               (memory-mapped AF_PACKET "
+		"RX/TX rings on the CAN\n"
+		"                          interfaces)\n");
+	fprintf(stderr, "         -y               (busy-poll the source "
+		"instead of waiting - with -D:\n"
+		"                          wake-to-process latency)\n");
+	fprintf(stderr, "         -P <prio>[:cpu]  (real-time mode: SCHED_FIFO "
+		"<prio>, pinned to <cpu>,\n"
+		"                          locked memory, 1 ns timer slack)\n");
+	fprintf(stderr, "         -M <name>        (export counters to shared "
+		"memory /dev/shm/<name>)\n");
+	fprintf(stderr, "         -D               (measure C-PDU dwell "
+		"times - dump with SIGUSR2)\n");
 	fprintf(stderr, "         -v               (verbose)\n");
+	fprintf(stderr, "         -V <n>           (asynchronous verbose "
+		"output for every <n>th frame)\n");
+	fprintf(stderr, "         -i               (<src_if> is a capture file "
+		"- offline conversion)\n");
+	fprintf(stderr, "         -o               (<dst_if> is a capture "
+		"file)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Instead of CAN interfaces fd:<n> (inherited socket) "
+		"and unix:<path> AF_UNIX\nSOCK_SEQPACKET transports can "
+		"be used (no CAN filters).\n");
+	fprintf(stderr, "The C-PDUs sent with -k are not looped back to local "
+		"CAN_RAW sockets.\n");
 }
 
 int main(int argc, char **argv)
@@ -43,21 +427,74 @@ int main(int argc, char **argv)
 	int opt;
 	canid_t transfer_id = DEFAULT_TRANSFER_ID;
 	unsigned int mpdu_max_size = MPDU_DEFAULT_SIZE;
+	int use_sendmmsg = 0;
+	int measure = 0;
 	int verbose = 0;
+	unsigned int trace_sample_rate = 0;
+	struct trace_ring *trace = NULL;
 
-	int src, dst;
+	/* decoupled C-PDU transmission in a separate thread */
+	unsigned int ring_slots = 0;
+	struct frame_ring *ring = NULL;
+	struct frame_slot *slot;
+	struct tx_ctx tx;
+	pthread_t tx_tid;
+
+	/* capture file input and output */
+	int file_in = 0, file_out = 0;
+	struct capture cap = { 0 };
+	struct canxl_frame *rec;
+	FILE *outfile = NULL;
+
+	int src = -1, dst = -1;
 	struct sockaddr_can addr;
 	struct can_filter rfilter;
 	struct canxl_frame cfsrc, cfdst;
-	struct c_pdu_header *c_pdu_hdr;
-	unsigned int dataptr = 0;
+	struct canxl_frame *rxf = &cfsrc, *txf = &cfdst;
+	struct mpdu_iter it;
+	struct cpdu c;
 	unsigned int padsz;
+	const char *err;
+
+	/* zero-copy C-PDU transmission with sendmmsg() */
+	struct canxl_hdr hdrs[MPDU_MAX_C_PDUS];
+	struct iovec iovs[MPDU_MAX_C_PDUS][2];
+	struct mmsghdr msgs[MPDU_MAX_C_PDUS];
+	unsigned int ncpdus, sent;
+	unsigned int cpducnt;
+
+	/* always-on counters (optionally in shared memory) */
+	struct mpdu_metrics local_metrics = { 0 };
+	struct mpdu_metrics *metrics = &local_metrics;
+
+	/* dwell time from M-PDU reception to C-PDU transmission */
+	struct dwell_stats dwell = { 0 };
+	struct sigaction sa;
+	struct msghdr msg;
+	struct iovec iov;
+	char ctrlmsg[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+		     CMSG_SPACE(sizeof(struct timeval)) +
+		     CMSG_SPACE(sizeof(__u32))];
+	__u64 rxstamp = 0, now, stall;
 
-	int nbytes, ret;
+	/* socket buffer sizes (0 = system default) and kernel drops */
+	int rcvbuf = 0, sndbuf = 0;
+	__u32 drops = 0, ndrops;
+
+	/* M-PDUs and C-PDUs in place in memory-mapped AF_PACKET rings */
+	int use_packet = 0;
+	int rt_prio = 0, rt_cpu = -1; /* real-time mode (0 = off) */
+	int busy_poll = 0; /* spin on the non-blocking source */
+	struct dwell_hist wake = { 0 }; /* wake-to-process latency */
+	struct pring sring, dring;
+	struct tpacket3_hdr *pkt;
+
+	int nbytes, ret, i;
 	int sockopt = 1;
+	int tsflags = DWELL_TSFLAGS;
 	struct timeval tv;
 
-	while ((opt = getopt(argc, argv, "t:l:vh?")) != -1) {
+	while ((opt = getopt(argc, argv, "t:l:mR:s:UkyP:M:DvV:ioh?")) != -1) {
 		switch (opt) {
 
 		case 't':
@@ -78,10 +515,72 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'm':
+			use_sendmmsg = 1;
+			break;
+
+		case 'R':
+			ring_slots = strtoul(optarg, NULL, 10);
+			if (ring_slots < 2 || ring_slots > MAX_RING_SLOTS ||
+			    ring_slots & (ring_slots - 1)) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 's':
+			if (sscanf(optarg, "%d:%d", &rcvbuf, &sndbuf) < 1 ||
+			    rcvbuf < 0 || sndbuf < 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'U':
+			use_uring = 1;
+			break;
+
+		case 'k':
+			use_packet = 1;
+			break;
+
+		case 'y':
+			busy_poll = 1;
+			break;
+
+		case 'P':
+			if (rt_parse(optarg, &rt_prio, &rt_cpu) < 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'M':
+			metrics = metrics_open(optarg, "mpdu2sdt");
+			if (!metrics)
+				return 1;
+			break;
+
+		case 'D':
+			measure = 1;
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
 
+		case 'V':
+			trace_sample_rate = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'i':
+			file_in = 1;
+			break;
+
+		case 'o':
+			file_out = 1;
+			break;
+
 		case '?':
 		case 'h':
 		default:
@@ -97,201 +596,545 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	/* the recorded timestamps are no base for dwell times */
+	if (measure && file_in) {
+		fprintf(stderr, "Option -D can not be combined with -i!\n\n");
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	/* sendmmsg() needs a socket */
+	if (use_sendmmsg && file_out) {
+		fprintf(stderr, "Option -m can not be combined with -o!\n\n");
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	/* io_uring has its own queue of linked sends */
+	if (use_uring && (use_sendmmsg || ring_slots || file_in || file_out)) {
+		fprintf(stderr, "Option -U can not be combined with -m, -R, -i "
+			"or -o!\n\n");
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	/* the io_uring completions and capture files are not spun */
+	if (busy_poll && (use_uring || file_in)) {
+		fprintf(stderr, "Option -y can not be combined with -U or "
+			"-i!\n\n");
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	/* both rings are bound to CAN interfaces */
+	if (use_packet && (use_sendmmsg || ring_slots || use_uring || file_in ||
+			   file_out || !transport_is_can(argv[optind]) ||
+			   !transport_is_can(argv[optind + 1]))) {
+		fprintf(stderr, "Option -k needs CAN interfaces and can not be "
+			"combined with -m, -R, -U, -i or -o!\n\n");
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
 	/* src_if */
-	if (strlen(argv[optind]) >= IFNAMSIZ) {
+	if (!file_in && transport_is_can(argv[optind]) &&
+	    strlen(argv[optind]) >= IFNAMSIZ) {
 		printf("Name of src CAN device '%s' is too long!\n\n",
 		       argv[optind]);
 		return 1;
 	}
 
 	/* dst_if */
-	if (strlen(argv[optind + 1]) >= IFNAMSIZ) {
+	if (!file_out && transport_is_can(argv[optind + 1]) &&
+	    strlen(argv[optind + 1]) >= IFNAMSIZ) {
 		printf("Name of dst CAN device '%s' is too long!\n\n",
 		       argv[optind]);
 		return 1;
 	}
 
-	/* open src socket */
-	src = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (src < 0) {
-		perror("src socket");
-		return 1;
+	/* open src capture file, transport or socket */
+	if (file_in) {
+		if (capture_open(&cap, argv[optind]) < 0)
+			return 1;
+	} else if (!transport_is_can(argv[optind])) {
+		src = transport_open(argv[optind]);
+		if (src < 0)
+			return 1;
+	} else if (use_packet) {
+		/* filter only for transfer_id (= prio_id) */
+		rfilter.can_id = transfer_id;
+		rfilter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+		if (pring_open(&sring, PRING_RX_BLOCKS, 0) < 0 ||
+		    pring_filter(&sring, 1, &rfilter, 1) < 0 ||
+		    pring_bind(&sring, if_nametoindex(argv[optind])) < 0)
+			return 1;
+		src = sring.s;
+	} else {
+		src = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (src < 0) {
+			perror("src socket");
+			return 1;
+		}
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = if_nametoindex(argv[optind]);
+
+		/* enable CAN XL frames */
+		ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
+				 &sockopt, sizeof(sockopt));
+		if (ret < 0) {
+			perror("src sockopt CAN_RAW_XL_FRAMES");
+			exit(1);
+		}
+
+		/* filter only for transfer_id (= prio_id) */
+		rfilter.can_id = transfer_id;
+		rfilter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+		ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_FILTER,
+				 &rfilter, sizeof(rfilter));
+		if (ret < 0) {
+			perror("src sockopt CAN_RAW_FILTER");
+			exit(1);
+		}
+
+		if (bind(src, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			return 1;
+		}
 	}
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = if_nametoindex(argv[optind]);
-
-	/* enable CAN XL frames */
-	ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
-			 &sockopt, sizeof(sockopt));
-	if (ret < 0) {
-		perror("src sockopt CAN_RAW_XL_FRAMES");
-		exit(1);
+
+	/* size the receive queue for bursts and detect its overflows */
+	if (!file_in && !use_packet) {
+		if (rcvbuf &&
+		    transport_bufsize(src, argv[optind], 1, rcvbuf) < 0)
+			return 1;
+
+		if (transport_drops_enable(src) < 0)
+			return 1;
 	}
 
-	/* filter only for transfer_id (= prio_id) */
-	rfilter.can_id = transfer_id;
-	rfilter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
-	ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_FILTER,
-			 &rfilter, sizeof(rfilter));
-	if (ret < 0) {
-		perror("src sockopt CAN_RAW_FILTER");
-		exit(1);
+	if (!file_in && busy_poll)
+		transport_busy_poll(src, argv[optind]);
+
+	/* software RX timestamps to measure the C-PDU dwell time */
+	if (measure) {
+		/* the RX ring always provides timestamps */
+		if (!use_packet &&
+		    transport_timestamps(src, argv[optind], tsflags) < 0)
+			exit(1);
+
+		/* no SA_RESTART to dump the histograms when waiting in read */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = sigusr2;
+		sigaction(SIGUSR2, &sa, NULL);
 	}
 
-	if (bind(src, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+	/* open dst capture file, transport or socket */
+	if (file_out) {
+		outfile = capture_create(argv[optind + 1]);
+		if (!outfile)
+			return 1;
+	} else if (!transport_is_can(argv[optind + 1])) {
+		dst = transport_open(argv[optind + 1]);
+		if (dst < 0)
+			return 1;
+	} else if (use_packet) {
+		if (pring_open(&dring, 0, PRING_TX_BLOCKS) < 0 ||
+		    pring_bind(&dring, if_nametoindex(argv[optind + 1])) < 0)
+			return 1;
+		dst = dring.s;
+	} else {
+		dst = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (dst < 0) {
+			perror("dst socket");
+			return 1;
+		}
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = if_nametoindex(argv[optind + 1]);
+
+		/* enable CAN XL frames */
+		ret = setsockopt(dst, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
+				 &sockopt, sizeof(sockopt));
+		if (ret < 0) {
+			perror("dst sockopt CAN_RAW_XL_FRAMES");
+			exit(1);
+		}
+
+		if (bind(dst, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			return 1;
+		}
 	}
 
-	/* open dst socket */
-	dst = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (dst < 0) {
-		perror("dst socket");
+	if (!file_out && !use_packet && sndbuf &&
+	    transport_bufsize(dst, argv[optind + 1], 0, sndbuf) < 0)
 		return 1;
+
+	/* the iovecs point to the C-PDU headers and the M-PDU payload */
+	memset(msgs, 0, sizeof(msgs));
+	for (ncpdus = 0; ncpdus < MPDU_MAX_C_PDUS; ncpdus++) {
+		iovs[ncpdus][0].iov_base = &hdrs[ncpdus];
+		iovs[ncpdus][0].iov_len = CANXL_HDR_SIZE;
+		msgs[ncpdus].msg_hdr.msg_iov = iovs[ncpdus];
+		msgs[ncpdus].msg_hdr.msg_iovlen = 2;
 	}
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = if_nametoindex(argv[optind + 1]);
-
-	/* enable CAN XL frames */
-	ret = setsockopt(dst, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
-			 &sockopt, sizeof(sockopt));
-	if (ret < 0) {
-		perror("dst sockopt CAN_RAW_XL_FRAMES");
-		exit(1);
+
+	if (use_uring) {
+		if (txq_create(&uring_txq, URING_TXQ_SIZE) < 0) {
+			perror("calloc");
+			return 1;
+		}
+
+		if (uring_init(&ur, URING_TXQ_SIZE + 8) < 0)
+			return 1;
+
+		/* buffer layout: recvmsg header, control messages, M-PDU */
+		uring_msg.msg_controllen = sizeof(ctrlmsg);
+		if (uring_bufs_init(&ur, &uring_bufs, 0, URING_RX_BUFS,
+				    sizeof(struct io_uring_recvmsg_out) +
+				    sizeof(ctrlmsg) +
+				    sizeof(struct canxl_frame)) < 0)
+			return 1;
 	}
 
-	if (bind(dst, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
+	/* lock the buffers and go real-time - the TX thread inherits it */
+	if (rt_prio && rt_enable(rt_prio, rt_cpu) < 0)
 		return 1;
+
+	if (ring_slots) {
+		ring = frame_ring_create(ring_slots);
+		if (!ring) {
+			fprintf(stderr, "can not create frame ring\n");
+			return 1;
+		}
+		metrics->ring_slots = ring_slots;
+
+		tx.ring = ring;
+		tx.dst = dst;
+		tx.outfile = outfile;
+		tx.file_in = file_in;
+		tx.use_sendmmsg = use_sendmmsg;
+		tx.measure = measure;
+		tx.dwell = &dwell;
+		tx.metrics = metrics;
+
+		if (pthread_create(&tx_tid, NULL, tx_thread, &tx)) {
+			fprintf(stderr, "can not start TX thread\n");
+			return 1;
+		}
+	}
+
+	if (trace_sample_rate) {
+		trace = trace_start(trace_sample_rate, &argv[optind],
+				    metrics_reason);
+		if (!trace) {
+			fprintf(stderr, "can not start trace thread\n");
+			return 1;
+		}
 	}
 
 	/* main loop */
 	while (1) {
 
+		if (dump_request) {
+			dump_request = 0;
+			dwell_dump(&dwell, "mpdu2sdt");
+			dwell_wake_dump(&wake, "mpdu2sdt", busy_poll);
+		}
+
 		/* read source CAN XL frame */
-		nbytes = read(src, &cfsrc, sizeof(struct canxl_frame));
+		if (file_in) {
+			/* filter only for transfer_id (= prio_id) */
+			do {
+				rec = capture_next(&cap, &rxstamp);
+			} while (rec && (rec->prio & CANXL_PRIO_MASK) != transfer_id);
+
+			if (!rec)
+				break; /* end of capture file */
+
+			nbytes = CANXL_HDR_SIZE + rec->len;
+			memcpy(&cfsrc, rec, nbytes);
+		} else if (use_packet) {
+			/* parse the M-PDU in place in the RX ring */
+			pkt = pring_rx_next(&sring);
+			if (!pkt) {
+				ndrops = pring_drops(&sring);
+				if (ndrops) {
+					metrics->drop_rxq += ndrops;
+					fprintf(stderr, "%s: %u frames dropped "
+						"(RX ring overflow)\n",
+						argv[optind], ndrops);
+				}
+
+				/* the ring is checked without syscalls */
+				if (busy_poll)
+					continue;
+
+				nbytes = pring_rx_wait(&sring);
+				METRICS_ADD(metrics->syscalls, 1);
+				if (nbytes < 0 && errno != EINTR) {
+					perror("poll");
+					return 1;
+				}
+				continue;
+			}
+
+			rxf = pring_data(pkt);
+			nbytes = pkt->tp_snaplen;
+			rxstamp = pring_tstamp(pkt);
+		} else {
+			/* control messages: RX timestamp and kernel drops */
+			if (use_uring) {
+				nbytes = uring_recv(src, dst, &cfsrc, &msg, ctrlmsg,
+						    sizeof(ctrlmsg), metrics);
+			} else {
+				iov.iov_base = &cfsrc;
+				iov.iov_len = sizeof(struct canxl_frame);
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = ctrlmsg;
+				msg.msg_controllen = sizeof(ctrlmsg);
+
+				nbytes = recvmsg(src, &msg,
+						 busy_poll ? MSG_DONTWAIT : 0);
+			}
+			if (nbytes < 0 && errno == EINTR)
+				continue;
+
+			if (nbytes < 0 && busy_poll && errno == EAGAIN) {
+				METRICS_ADD(metrics->syscalls, 1);
+				continue;
+			}
+
+			if (measure)
+				rxstamp = dwell_rxstamp(&msg);
+
+			ndrops = transport_drops(&msg, &drops);
+			if (ndrops) {
+				metrics->drop_rxq += ndrops;
+				fprintf(stderr, "%s: %u frames dropped (socket "
+					"receive queue overflow)\n",
+					argv[optind], ndrops);
+			}
+		}
+
+		if (!file_in && !use_uring && !use_packet)
+			METRICS_ADD(metrics->syscalls, 1);
 		if (nbytes < 0) {
 			perror("read");
 			return 1;
 		}
 
-		if (nbytes < CANXL_HDR_SIZE + CANXL_MIN_DLEN) {
-			fprintf(stderr, "read: no CAN frame\n");
-			return 1;
-		}
+		/* end of a fd:/unix: transport connection */
+		if (!nbytes)
+			break;
 
-		if (!(cfsrc.flags & CANXL_XLF)) {
-			fprintf(stderr, "read: no CAN XL frame flag\n");
+		err = frame_check((struct canxl_hdr *)rxf, nbytes);
+		if (err) {
+			fprintf(stderr, "read: %s\n", err);
 			return 1;
 		}
 
-		if (nbytes != CANXL_HDR_SIZE + cfsrc.len) {
-			printf("nbytes = %d\n", nbytes);
-			fprintf(stderr, "read: no CAN XL frame len\n");
+		metrics->frames_in++;
+		metrics->bytes_in += nbytes;
+
+		if (measure && rxstamp && !file_in)
+			dwell_hist_add(&wake, dwell_now() - rxstamp);
+
+		if (verbose && (file_in || use_packet)) {
+			tv.tv_sec = rxstamp / 1000000000ULL;
+			tv.tv_usec = (rxstamp % 1000000000ULL) / 1000;
+		} else if (verbose &&
+			   transport_stamp(src, argv[optind], &tv) < 0) {
+			perror("SIOCGSTAMP");
 			return 1;
 		}
 
 		if (verbose) {
-			if (ioctl(src, SIOCGSTAMP, &tv) < 0) {
-				perror("SIOCGSTAMP");
-				return 1;
-			}
-
 			/* print timestamp and device name */
 			printf("\n(%ld.%06ld) %s ", tv.tv_sec, tv.tv_usec,
 			       argv[optind]);
 
-			printxlframe(&cfsrc);
+			printxlframe(rxf);
 		}
 
-		if (cfsrc.sdt != MPDU_SDT) {
-			printf("dropped received PDU as it is no M-PDU frame!");
-                        continue;
-		}
+		if (trace && trace_sample(trace))
+			trace_frame(trace, 0, (struct canxl_hdr *)rxf,
+				    rxf->data, rxstamp);
 
-		/* size must be a padded length value */
-		if (cfsrc.len % 4) {
-			fprintf(stderr, "M-PDU not padded correctly (%d)\n",
-				cfsrc.len);
-			return 1;
+		/* no M-PDU or beyond the M-PDU max size limit */
+		err = mpdu_check((struct canxl_hdr *)rxf, mpdu_max_size,
+				 metrics);
+		if (err) {
+			printf("dropped received PDU (%s)!", err);
+			continue;
 		}
 
-		/* size must be at least one C-PDU header and a padded byte */
-		if (cfsrc.len < MPDU_MIN_SIZE) {
-			fprintf(stderr, "M-PDU content too short (%d)\n",
-				cfsrc.len);
+		/* start to decompose */
+		ret = mpdu_iter_init(&it, rxf->data, rxf->len);
+		if (ret < 0) {
+			fprintf(stderr, "%s (%d)\n", mpdu_strerror(ret),
+				rxf->len);
 			return 1;
 		}
 
-		/* check for M-PDU max size limit */
-		if (cfsrc.len > mpdu_max_size) {
-			printf("dropped received PDU as it exceeds the M-PDU size limit!");
-			continue;
-		}
+		ncpdus = 0;
+		cpducnt = 0;
 
-		/* start to decompose */
-		dataptr = 0;
+		while ((ret = mpdu_iter_next(&it, &c)) > 0) {
 
-		while (1) {
+			cpducnt++;
+			padsz = cpdu_padsz(c.c_dlen);
 
-			/* check for minimum length of C-PDU */
-			if (dataptr > cfsrc.len - MPDU_MIN_SIZE)
-				break;
+			if (trace && trace->sampled)
+				trace_cpdu(trace, TRACE_SEND_CPDU, c.c_type,
+					   c.c_info, c.c_dlen, c.c_id, padsz,
+					   it.pos);
 
-			c_pdu_hdr = (struct c_pdu_header *) &cfsrc.data[dataptr];
+			if (verbose) {
+				printf("%s C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
+				       (use_sendmmsg || ring) ? "adding" : "sending",
+				       c.c_type, c.c_info, c.c_dlen, c.c_id,
+				       padsz, it.pos);
+			}
 
-			padsz = ntohs(c_pdu_hdr->c_dlen); /* get real data length */
+			if (ring) {
+				/* hand over the C-PDU to the TX thread */
+				slot = frame_ring_reserve(ring);
+				if (!slot) {
+					/* TX is behind - push back on the source */
+					metrics->ring_overflow++;
+					slot = frame_ring_reserve_wait(ring);
+				}
 
-			/* we have at least one data byte in a CAN XL frame */
-			if (padsz < 1)
-				break;
+				slot->tstamp = rxstamp;
+				cpdu_frame(&slot->cf, &c, transfer_id);
+				frame_ring_commit(ring);
+				continue;
+			}
 
-			/* need to round up to next 4 byte boundary? */
-			if (padsz % 4)
-				padsz += (4 - padsz % 4);
+			if (use_sendmmsg) {
+				/* only build the header - data stays in the M-PDU */
+				cpdu_hdr(&hdrs[ncpdus], &c, transfer_id);
 
-			/* does the C-PDU incl. data fit into the M-PDU space? */
-			if (C_PDU_HEADER_SIZE + padsz > cfsrc.len - dataptr) {
-				fprintf(stderr, "C-PDU content too long (%lu > %d)\n",
-					C_PDU_HEADER_SIZE + padsz, cfsrc.len - dataptr);
-				return 1;
+				iovs[ncpdus][1].iov_base = c.data;
+				iovs[ncpdus][1].iov_len = c.c_dlen;
+				ncpdus++;
+				continue;
 			}
 
+			/* compose the C-PDU in place in the TX ring */
+			if (use_packet)
+				txf = packet_slot(&dring, metrics);
+
 			/* create a valid STD frame from this C-PDU element */
-			cfdst.prio = transfer_id;
-			cfdst.flags = CANXL_XLF; /* no SEC bit */
-			cfdst.sdt = c_pdu_hdr->c_type;
-			cfdst.len = ntohs(c_pdu_hdr->c_dlen);
-			cfdst.af = ntohl(c_pdu_hdr->c_id);
+			cpdu_frame(txf, &c, transfer_id);
 
-			dataptr += C_PDU_HEADER_SIZE;
+			if (use_packet) {
+				pring_tx_put(&dring, CANXL_HDR_SIZE + txf->len);
+				metrics->frames_out++;
+				metrics->bytes_out += CANXL_HDR_SIZE + txf->len;
+			} else
+				send_cpdu(dst, outfile, file_in ? rxstamp :
+					  dwell_now(), txf, metrics);
 
-			/* copy data - cfsrc.data is zero padded */
-			memcpy(cfdst.data, &cfsrc.data[dataptr], padsz);
+			if (measure && rxstamp)
+				dwell_add(&dwell, txf->sdt, dwell_now() - rxstamp);
 
-			dataptr += padsz;
+		} /* while (mpdu_iter_next()) */
 
-			if (verbose) {
-				printf("sending C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
-				       c_pdu_hdr->c_type, c_pdu_hdr->c_info,
-				       ntohs(c_pdu_hdr->c_dlen),
-				       ntohl(c_pdu_hdr->c_id), padsz, dataptr);
+		if (ret < 0) {
+			fprintf(stderr, "%s (offset %u)\n", mpdu_strerror(ret),
+				it.pos);
+			return 1;
+		}
+
+		/* one syscall for all C-PDUs of the M-PDU */
+		if (use_packet)
+			packet_flush(&dring, metrics);
+
+		if (ring) {
+			frame_ring_kick(ring);
+
+			metrics->ring_used = frame_ring_used(ring);
+			if (metrics->ring_used > metrics->ring_max)
+				metrics->ring_max = metrics->ring_used;
+		}
+
+		/* write all C-PDU frames with one syscall (if possible) */
+		for (sent = 0, stall = 0; sent < ncpdus; sent += ret) {
+			ret = sendmmsg(dst, &msgs[sent], ncpdus - sent,
+				       MSG_DONTWAIT);
+			METRICS_ADD(metrics->syscalls, 1);
+			if (ret < 0 && tx_transient(errno)) {
+				tx_stall(dst, errno, &stall, metrics);
+				ret = 0;
+				continue;
 			}
 
-			/* write C-PDU frame to destination socket */
-			nbytes = write(dst, &cfdst, CANXL_HDR_SIZE + cfdst.len);
-			if (nbytes != CANXL_HDR_SIZE + cfdst.len) {
-				printf("nbytes = %d\n", nbytes);
-				perror("write dst canxl_frame");
+			if (ret < 0) {
+				perror("sendmmsg dst canxl_frames");
 				exit(1);
 			}
 
-		} /* while (1) */
+			metrics->frames_out += ret;
+			for (i = sent; i < sent + ret; i++)
+				metrics->bytes_out += CANXL_HDR_SIZE +
+					hdrs[i].len;
+
+			if (verbose)
+				printf("sent %d of %u C-PDUs\n", ret, ncpdus - sent);
+		}
+
+		tx_stall_end(&stall, dwell_now, metrics);
+
+		metrics_mpdu(metrics, rxf->len, mpdu_max_size, cpducnt);
+
+		if (measure && rxstamp && ncpdus) {
+			now = dwell_now();
+			for (sent = 0; sent < ncpdus; sent++)
+				dwell_add(&dwell, hdrs[sent].sdt, now - rxstamp);
+		}
 
 	} /* while (1) */
 
-	close(src);
-	close(dst);
+	/* send out the queued C-PDUs */
+	if (ring) {
+		frame_ring_stop(ring);
+		pthread_join(tx_tid, NULL);
+		frame_ring_free(ring);
+	}
+
+	if (use_uring) {
+		while (txq_len(&uring_txq))
+			uring_wait(dst, metrics);
+		uring_exit(&ur);
+	}
+
+	if (file_in)
+		capture_close(&cap);
+	else if (use_packet)
+		pring_close(&sring);
+	else
+		close(src);
+
+	if (outfile) {
+		if (fclose(outfile)) {
+			perror("capture close");
+			return 1;
+		}
+	} else if (use_packet)
+		pring_close(&dring);
+	else
+		close(dst);
+
+	if (trace)
+		trace_stop(trace);
+
+	if (measure) {
+		dwell_dump(&dwell, "mpdu2sdt");
+		dwell_wake_dump(&wake, "mpdu2sdt", busy_poll);
+	}
 
 	return 0;
 }
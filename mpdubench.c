@@ -0,0 +1,356 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * mpdubench.c - socket-free benchmark of the M-PDU compose/decompose paths
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/can.h>
+#include <linux/perf_event.h>
+
+#include "cia-611-2.h"
+
+#define DEFAULT_COUNT 1000000
+#define SIZES 4096 /* pregenerated C-PDU data lengths (power of 2) */
+#define MAX_MPDUS 4096 /* M-PDUs for the decomposer input */
+
+extern int optind, opterr, optopt;
+
+/* synthetic C-PDU data length distributions */
+struct dist {
+	const char *name;
+	const char *desc;
+};
+
+static const struct dist dists[] = {
+	{ "cc", "all 8 byte (Classical CAN)" },
+	{ "fd", "all 64 byte (CAN FD)" },
+	{ "mixed", "50% 8 byte, 30% 64 byte, 20% 1 .. max byte" },
+	{ "xl", "1 .. max byte (CAN XL)" },
+};
+
+#define NDISTS (sizeof(dists) / sizeof(dists[0]))
+
+struct counters {
+	int fd[2]; /* cycles, instructions (-1 = not available) */
+	__u64 val[2];
+};
+
+struct result {
+	__u64 ns;
+	__u64 cpdus;
+	__u64 bytes;
+	__u64 mpdus;
+	struct counters pc;
+};
+
+static __u16 sizes[SIZES];
+static __u8 payload[CANXL_MAX_DLEN];
+static unsigned int mpdu_max_size = MPDU_DEFAULT_SIZE;
+static volatile __u64 sink; /* keeps the results alive */
+
+void print_usage(char *prg)
+{
+	unsigned int i;
+
+	fprintf(stderr, "%s - M-PDU compose/decompose benchmark\n\n", prg);
+	fprintf(stderr, "Usage: %s [options]\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -n <count>  (number of C-PDUs per run "
+		"- default: %d)\n", DEFAULT_COUNT);
+	fprintf(stderr, "         -l <size>   (limit PDU size"
+		" to %ld .. %d, default: %d)\n", MPDU_MIN_SIZE, MPDU_MAX_SIZE,
+		MPDU_DEFAULT_SIZE);
+	fprintf(stderr, "         -d <dist>   (run only the given "
+		"distribution)\n");
+	fprintf(stderr, "\nC-PDU data length distributions:\n");
+	for (i = 0; i < NDISTS; i++)
+		fprintf(stderr, "  %-6s %s\n", dists[i].name, dists[i].desc);
+	fprintf(stderr, "\nThe max. C-PDU data length is the M-PDU size "
+		"limit minus the C-PDU header.\n");
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int perf_open(__u64 config, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = (group < 0);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* cycles and instructions of this thread (if supported) */
+static void counters_start(struct counters *pc)
+{
+	pc->fd[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+	pc->fd[1] = -1;
+	if (pc->fd[0] < 0)
+		return;
+
+	pc->fd[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, pc->fd[0]);
+
+	ioctl(pc->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(pc->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void counters_stop(struct counters *pc)
+{
+	int i;
+
+	if (pc->fd[0] >= 0)
+		ioctl(pc->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	for (i = 0; i < 2; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+
+		if (read(pc->fd[i], &pc->val[i], sizeof(pc->val[i])) !=
+		    sizeof(pc->val[i]))
+			pc->fd[i] = -1;
+		else
+			close(pc->fd[i]);
+	}
+}
+
+static void gen_sizes(unsigned int dist)
+{
+	unsigned int max_dlen = mpdu_max_size - C_PDU_HEADER_SIZE;
+	unsigned int i, r;
+
+	srandom(dist + 1); /* reproducible */
+
+	for (i = 0; i < SIZES; i++) {
+		r = random();
+
+		switch (dist) {
+		case 0:
+			sizes[i] = 8;
+			break;
+		case 1:
+			sizes[i] = 64;
+			break;
+		case 2:
+			if (r % 10 < 5)
+				sizes[i] = 8;
+			else if (r % 10 < 8)
+				sizes[i] = 64;
+			else
+				sizes[i] = 1 + (r / 10) % max_dlen;
+			break;
+		default:
+			sizes[i] = 1 + r % max_dlen;
+			break;
+		}
+
+		if (sizes[i] > max_dlen)
+			sizes[i] = max_dlen;
+	}
+}
+
+/* C-PDU packing like sdt2mpdu: send the M-PDU when the C-PDU does not fit */
+static void bench_compose(unsigned int count, struct result *res)
+{
+	static __u8 mpdu[CANXL_MAX_DLEN];
+	struct mpdu_builder mb;
+	struct cpdu c = {
+		.c_type = 0x03,
+		.c_info = DEFAULT_VCID,
+		.c_id = DEFAULT_AF,
+		.data = payload,
+	};
+	__u64 start, sum = 0;
+	unsigned int i;
+
+	memset(res, 0, sizeof(*res));
+	mpdu_init(&mb, mpdu, mpdu_max_size);
+
+	counters_start(&res->pc);
+	start = now_ns();
+
+	for (i = 0; i < count; i++) {
+		c.c_dlen = sizes[i & (SIZES - 1)];
+
+		if (!mpdu_fits(&mb, c.c_dlen)) {
+			sum += mb.len;
+			res->mpdus++;
+			mpdu_init(&mb, mpdu, mpdu_max_size);
+		}
+
+		mpdu_append(&mb, &c);
+		res->bytes += c.c_dlen;
+	}
+
+	res->ns = now_ns() - start;
+	counters_stop(&res->pc);
+
+	res->cpdus = count;
+	sink = sum + mb.len;
+}
+
+/* C-PDU extraction like mpdu2sdt: copy each C-PDU into a CAN XL frame */
+static void bench_decompose(unsigned int count, struct result *res)
+{
+	static struct canxl_frame cfsrc[MAX_MPDUS];
+	struct canxl_frame cfdst;
+	struct mpdu_builder mb;
+	struct mpdu_iter it;
+	struct cpdu c = {
+		.c_type = 0x03,
+		.c_info = DEFAULT_VCID,
+		.c_id = DEFAULT_AF,
+		.data = payload,
+	};
+	unsigned int nmpdus = 0, i = 0, m;
+	__u64 start, sum = 0;
+
+	memset(res, 0, sizeof(*res));
+
+	/* compose the input M-PDUs */
+	mpdu_init(&mb, cfsrc[0].data, mpdu_max_size);
+	while (nmpdus < MAX_MPDUS) {
+		c.c_dlen = sizes[i++ & (SIZES - 1)];
+
+		if (!mpdu_fits(&mb, c.c_dlen)) {
+			cfsrc[nmpdus].len = mb.len;
+			if (++nmpdus == MAX_MPDUS)
+				break;
+			mpdu_init(&mb, cfsrc[nmpdus].data, mpdu_max_size);
+		}
+
+		mpdu_append(&mb, &c);
+	}
+
+	counters_start(&res->pc);
+	start = now_ns();
+
+	for (m = 0; res->cpdus < count; m = (m + 1) & (MAX_MPDUS - 1)) {
+		if (mpdu_iter_init(&it, cfsrc[m].data, cfsrc[m].len) < 0)
+			break;
+
+		while (mpdu_iter_next(&it, &c) > 0) {
+			cfdst.sdt = c.c_type;
+			cfdst.len = c.c_dlen;
+			cfdst.af = c.c_id;
+			memcpy(cfdst.data, c.data, cpdu_padsz(c.c_dlen));
+
+			sum += cfdst.data[0];
+			res->bytes += c.c_dlen;
+			res->cpdus++;
+		}
+		res->mpdus++;
+	}
+
+	res->ns = now_ns() - start;
+	counters_stop(&res->pc);
+
+	sink = sum;
+}
+
+static void print_result(const char *op, const char *dist,
+			 struct result *res)
+{
+	double ns = res->ns ? res->ns : 1;
+
+	printf("%-9s %-6s %9llu C-PDUs %8.1f ns/C-PDU %8.3f M C-PDUs/s "
+	       "%9.1f MB/s %6.1f C-PDUs/M-PDU", op, dist, res->cpdus,
+	       ns / res->cpdus, res->cpdus * 1000.0 / ns,
+	       res->bytes * 1000.0 / ns,
+	       res->mpdus ? (double)res->cpdus / res->mpdus : 0.0);
+
+	if (res->pc.fd[0] >= 0)
+		printf(" %7.1f cycles/C-PDU", (double)res->pc.val[0] / res->cpdus);
+	else
+		printf("     n/a cycles/C-PDU");
+
+	if (res->pc.fd[1] >= 0)
+		printf(" %7.1f instr/C-PDU", (double)res->pc.val[1] / res->cpdus);
+	else
+		printf("     n/a instr/C-PDU");
+
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	unsigned int count = DEFAULT_COUNT;
+	char *only = NULL;
+	struct result res;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "n:l:d:h?")) != -1) {
+		switch (opt) {
+
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			if (!count) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'l':
+			mpdu_max_size = strtoul(optarg, NULL, 10);
+			if (mpdu_max_size < MPDU_MIN_SIZE ||
+			    mpdu_max_size > MPDU_MAX_SIZE ||
+			    mpdu_max_size % 4) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'd':
+			only = optarg;
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = i;
+
+	for (i = 0; i < NDISTS; i++) {
+		if (only && strcmp(only, dists[i].name))
+			continue;
+
+		gen_sizes(i);
+
+		bench_compose(count, &res);
+		print_result("compose", dists[i].name, &res);
+
+		bench_decompose(count, &res);
+		print_result("decompose", dists[i].name, &res);
+	}
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * mpducore.h - M-PDU compose/decompose core of the tools and the gateway
+ *
+ * The steps that sdt2mpdu, mpdu2sdt and the pipelines of mpdugw have in
+ * common: checking the received CAN XL frames, turning CAN XL frames into
+ * the C-PDUs of an M-PDU and back, counting the composed M-PDUs and the
+ * non-blocking transmission to the destination with the pending queue of
+ * txqueue.h and its stall accounting.
+ *
+ * Malformed input is only reported to the caller - the tools give up, the
+ * gateway drops the frame. The stall times are taken from the clock of
+ * the caller (offline replay, dwell time stamps) - only when stalled.
+ */
+
+#ifndef MPDUCORE_H
+#define MPDUCORE_H
+
+#include <string.h>
+#include <errno.h>
+#include <linux/types.h>
+#include <linux/can.h>
+#include "cia-611-2.h"
+#include "metrics.h"
+#include "txqueue.h"
+
+/* check a received CAN XL frame: NULL = valid, otherwise the reason */
+static inline const char *frame_check(struct canxl_hdr *hdr, int nbytes)
+{
+	if (nbytes < (int)(CANXL_HDR_SIZE + CANXL_MIN_DLEN))
+		return "no CAN frame";
+
+	if (!(hdr->flags & CANXL_XLF))
+		return "no CAN XL frame flag";
+
+	if (nbytes != (int)(CANXL_HDR_SIZE + hdr->len))
+		return "no CAN XL frame len";
+
+	return NULL;
+}
+
+/*
+ * compose: a C-PDU that never fits into an M-PDU of the size limit is
+ * counted as dropped (1 = drop)
+ */
+static inline int cpdu_oversize(unsigned int len, unsigned int mpdu_max_size,
+				struct mpdu_metrics *m)
+{
+	if (C_PDU_HEADER_SIZE + cpdu_padsz(len) <= mpdu_max_size)
+		return 0;
+
+	m->drop_oversize++;
+	return 1;
+}
+
+/* compose: C-PDU of a received CAN XL frame (data may be already in place) */
+static inline void cpdu_compose(struct cpdu *c, struct canxl_hdr *hdr,
+				__u8 vcid, __u8 *data)
+{
+	c->c_type = hdr->sdt;
+	c->c_info = vcid;
+	c->c_dlen = hdr->len;
+	c->c_id = hdr->af;
+	c->data = data;
+}
+
+/* compose: start an empty M-PDU in the CAN XL frame of the transfer ID */
+static inline void mpdu_start(struct mpdu_builder *mb, struct canxl_frame *cf,
+			      canid_t prio, unsigned int mpdu_max_size)
+{
+	mpdu_init(mb, cf->data, mpdu_max_size);
+
+	cf->prio = prio; /* transfer_id */
+	cf->flags = CANXL_XLF; /* no SEC bit */
+	cf->sdt = MPDU_SDT;
+	cf->af = DEFAULT_AF;
+}
+
+/* compose: complete the M-PDU frame for the transmission and count it */
+static inline void mpdu_finish(struct mpdu_builder *mb, struct canxl_frame *cf,
+			       int reason, unsigned int mpdu_max_size,
+			       struct mpdu_metrics *m)
+{
+	cf->len = mb->len;
+
+	m->frames_out++;
+	m->bytes_out += CANXL_HDR_SIZE + mb->len;
+	m->mpdus[reason]++;
+	metrics_mpdu(m, mb->len, mpdu_max_size, mb->ncpdus);
+}
+
+/*
+ * decompose: a received frame that is no M-PDU or exceeds the size limit
+ * is counted as dropped (NULL = M-PDU, otherwise the reason)
+ */
+static inline const char *mpdu_check(struct canxl_hdr *hdr,
+				     unsigned int mpdu_max_size,
+				     struct mpdu_metrics *m)
+{
+	if (hdr->sdt != MPDU_SDT) {
+		m->drop_no_mpdu++;
+		return "no M-PDU frame";
+	}
+
+	if (hdr->len > mpdu_max_size) {
+		m->drop_oversize++;
+		return "exceeds the M-PDU size limit";
+	}
+
+	return NULL;
+}
+
+/* decompose: CAN XL frame header of the C-PDU element */
+static inline void cpdu_hdr(struct canxl_hdr *hdr, const struct cpdu *c,
+			    canid_t prio)
+{
+	hdr->prio = prio; /* transfer_id */
+	hdr->flags = CANXL_XLF; /* no SEC bit */
+	hdr->sdt = c->c_type;
+	hdr->len = c->c_dlen;
+	hdr->af = c->c_id;
+}
+
+/* decompose: create a valid CAN XL frame from the C-PDU element */
+static inline void cpdu_frame(struct canxl_frame *cf, const struct cpdu *c,
+			      canid_t prio)
+{
+	cpdu_hdr((struct canxl_hdr *)cf, c, prio);
+
+	/* copy data - the M-PDU data is zero padded */
+	memcpy(cf->data, c->data, cpdu_padsz(c->c_dlen));
+}
+
+/* the destination did not take a frame (since = 0: not stalled before) */
+static inline void tx_stall_begin(__u64 *since, __u64 (*clock)(void),
+				  struct mpdu_metrics *m)
+{
+	if (!*since) {
+		*since = clock();
+		m->tx_stalls++;
+	}
+}
+
+/* the destination takes frames again */
+static inline void tx_stall_end(__u64 *since, __u64 (*clock)(void),
+				struct mpdu_metrics *m)
+{
+	if (*since) {
+		m->tx_stall_ns += clock() - *since;
+		*since = 0;
+	}
+}
+
+/* non-blocking transmission to a destination socket */
+struct tx_dst {
+	int s;
+	struct txq q; /* frames waiting for the destination */
+	__u64 stall_start; /* blocked since (0 = not blocked) */
+	__u64 retry; /* next send attempt after ENOBUFS */
+	__u64 (*clock)(void); /* ns */
+	struct mpdu_metrics *metrics;
+};
+
+/* the destination did not take the frame (err = EAGAIN/ENOBUFS) */
+static inline void tx_dst_blocked(struct tx_dst *tx, int err)
+{
+	tx->q.err = err;
+	if (err == ENOBUFS)
+		tx->retry = tx->clock() + TXQ_RETRY_NS;
+
+	tx_stall_begin(&tx->stall_start, tx->clock, tx->metrics);
+}
+
+/* keep the frame until the destination takes it (queue must not be full) */
+static inline void tx_dst_queue(struct tx_dst *tx, struct canxl_frame *cfx)
+{
+	txq_push(&tx->q, cfx);
+
+	tx->metrics->txq_len = txq_len(&tx->q);
+	if (tx->metrics->txq_len > tx->metrics->txq_max)
+		tx->metrics->txq_max = tx->metrics->txq_len;
+}
+
+/* send the pending frames until the destination blocks: -1 = error */
+static inline int tx_dst_flush(struct tx_dst *tx)
+{
+	int ret;
+
+	while (txq_len(&tx->q)) {
+		ret = tx_frame(tx->s, txq_front(&tx->q));
+		tx->metrics->syscalls++;
+		if (ret < 0)
+			return -1;
+
+		if (!ret) {
+			tx_dst_blocked(tx, errno);
+			break;
+		}
+
+		txq_pop(&tx->q);
+	}
+
+	tx->metrics->txq_len = txq_len(&tx->q);
+	if (!txq_len(&tx->q))
+		tx_stall_end(&tx->stall_start, tx->clock, tx->metrics);
+
+	return 0;
+}
+
+/*
+ * send without blocking - the frame is queued while the destination is
+ * blocked (the queue must not be full): -1 = error
+ */
+static inline int tx_dst_send(struct tx_dst *tx, struct canxl_frame *cfx)
+{
+	int ret;
+
+	if (!txq_len(&tx->q)) {
+		ret = tx_frame(tx->s, cfx);
+		tx->metrics->syscalls++;
+		if (ret)
+			return ret > 0 ? 0 : -1;
+
+		tx_dst_blocked(tx, errno);
+	}
+
+	tx_dst_queue(tx, cfx);
+
+	return 0;
+}
+
+#endif /* MPDUCORE_H */
@@ -0,0 +1,1275 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * mpdugw.c - CAN XL CiA 611-2 M-PDU gateway daemon
+ *
+ * Runs the compose (sdt2mpdu) and decompose (mpdu2sdt) pipelines that are
+ * described in a config file in one process. The pipelines are sharded
+ * across event loops - one thread per CPU that is pinned with its CPU
+ * affinity. Each pipeline with its sockets and open M-PDUs is owned by
+ * exactly one event loop, so the loops share no state and need no locks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <net/if.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "cia-611-2.h"
+#include "metrics.h"
+#include "transport.h"
+#include "txqueue.h"
+#include "rtmode.h"
+#include "timerwheel.h"
+#include "mpducore.h"
+
+#define MAX_PIPES 256 /* max. number of pipelines in the config file */
+#define MAX_SRC_IF 16 /* max. number of source interfaces per pipeline */
+#define MAX_TRANSFER_IDS 64 /* max. number of -t options per pipeline */
+#define MAX_ARGS (2 * MAX_TRANSFER_IDS + MAX_SRC_IF + 16)
+#define MAX_EVENTS 64
+#define RX_BUDGET 64 /* frames per source and wakeup (fairness) */
+#define DECOMPOSE_TXQ_SIZE (MPDU_MAX_C_PDUS + TXQ_DEFAULT_SIZE)
+#define CTRLMSG_SIZE CMSG_SPACE(sizeof(__u32))
+#define LOG_INTERVAL_NS 1000000000ULL /* rate limit of the drop messages */
+#define LOG_BURST 10 /* drop messages per interval and pipeline */
+
+extern int optind, opterr, optopt;
+
+enum {
+	PIPE_COMPOSE,
+	PIPE_DECOMPOSE,
+};
+
+/* epoll event sources */
+enum {
+	PORT_SRC,
+	PORT_DST,
+	PORT_TIMER,
+	PORT_WAKE,
+};
+
+struct gw_pipe;
+
+struct gw_port {
+	int type;
+	struct gw_pipe *p;
+	char *name;
+	int s; /* socket */
+	__u8 vcid; /* source identity that is put into the C-PDU c_info */
+	__u32 drops; /* kernel drop counter of the socket (SO_RXQ_OVFL) */
+	int closed; /* end of a fd:/unix: transport connection */
+};
+
+/* open M-PDU of a transfer ID (and source interface with -e) */
+struct gw_stream {
+	struct tw_timer timer; /* M-PDU timeout */
+	__u64 deadline; /* CLOCK_MONOTONIC in ns */
+	struct mpdu_builder mb;
+	struct canxl_frame cf;
+};
+
+struct gw_pipe {
+	int type;
+	unsigned int line; /* position in the config file */
+	int cpu; /* event loop CPU (-1 = automatic) */
+	struct gw_loop *loop;
+
+	struct gw_port srcs[MAX_SRC_IF];
+	unsigned int nsrcs;
+	unsigned int nopen; /* sources with an open connection */
+	struct gw_port dst;
+
+	canid_t tids[MAX_TRANSFER_IDS];
+	unsigned int ntids;
+	unsigned int mpdu_max_size;
+	unsigned long timeout_ms;
+	unsigned int max_cpdus; /* send M-PDU after max_cpdus C-PDUs */
+	int per_vcid; /* separate M-PDUs for each source interface */
+	char *metrics_name;
+	struct mpdu_metrics local_metrics;
+	struct mpdu_metrics *metrics;
+
+	/* compose: one M-PDU per transfer ID (-e: and source interface) */
+	struct gw_stream *streams;
+	struct timer_wheel *wheel; /* deadlines of the open M-PDUs */
+
+	/* non-blocking transmission (see mpducore.h) */
+	struct tx_dst tx;
+	unsigned int txq_room; /* max. frames produced by one received frame */
+	int dst_polled; /* waiting for EPOLLOUT on dst */
+	int paused; /* no reception while the queue is full */
+	int done;
+
+	/* rate limited messages about dropped frames */
+	__u64 log_start;
+	unsigned int log_cnt;
+	unsigned int log_missed;
+};
+
+/* event loop of one CPU */
+struct gw_loop {
+	int cpu;
+	pthread_t tid;
+	int efd; /* epoll */
+	struct gw_port timer; /* timerfd for M-PDU timeouts and retries */
+	struct gw_port wake; /* eventfd for requests of the main thread */
+	__u64 timer_deadline; /* currently armed timeout (0 = stopped) */
+	struct gw_pipe *pipes[MAX_PIPES];
+	unsigned int npipes;
+	unsigned int nrunning;
+	unsigned int weight; /* number of sources of the pipelines */
+	int demand; /* send all open M-PDUs (main thread request) */
+	int stop; /* terminate (main thread request) */
+};
+
+static struct gw_pipe pipes[MAX_PIPES];
+static unsigned int npipes;
+static struct gw_loop *loops;
+static unsigned int nloops;
+static int done_fd; /* eventfd: number of terminated event loops */
+static int verbose;
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "%s - CAN XL CiA 611-2 M-PDU gateway daemon\n\n", prg);
+	fprintf(stderr, "Usage: %s [options] <config_file>\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -C <cpus>        (CPUs for the event loops "
+		"e.g. 0-3,6 - default: all\n"
+		"                          CPUs of the process affinity)\n");
+	fprintf(stderr, "         -P <prio>        (real-time mode: SCHED_FIFO "
+		"<prio> for the event loops,\n"
+		"                          locked memory, 1 ns timer slack)\n");
+	fprintf(stderr, "         -v               (verbose)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Config file: one pipeline per line, '#' starts a "
+		"comment.\n");
+	fprintf(stderr, "  compose [options] <src_if>[:<vcid>] "
+		"[<src_if>[:<vcid>] ...] <dst_if>\n");
+	fprintf(stderr, "  decompose [options] <src_if> <dst_if>\n");
+	fprintf(stderr, "Pipeline options:\n");
+	fprintf(stderr, "         -t <transfer_id> (TRANSFER ID "
+		"- default: 0x%03X - compose: up to %d times)\n",
+		DEFAULT_TRANSFER_ID, MAX_TRANSFER_IDS);
+	fprintf(stderr, "         -l <size>        (limit PDU size"
+		" to %ld .. %d, default: %d)\n", MPDU_MIN_SIZE, MPDU_MAX_SIZE,
+		MPDU_DEFAULT_SIZE);
+	fprintf(stderr, "         -T <timeout_ms>  (compose: M-PDU transmission "
+		"timeout - default: %d msecs)\n", MPDU_DEFAULT_TIMEOUT_MS);
+	fprintf(stderr, "         -n <count>       (compose: send M-PDU after "
+		"<count> C-PDUs - default: off)\n");
+	fprintf(stderr, "         -e               (compose: separate M-PDUs "
+		"for each source interface)\n");
+	fprintf(stderr, "         -C <cpu>         (run the pipeline in the "
+		"event loop of <cpu>)\n");
+	fprintf(stderr, "         -M <name>        (export counters to shared "
+		"memory /dev/shm/<name>)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The options have the meaning of the sdt2mpdu and "
+		"mpdu2sdt options. The\npipelines without -C are distributed "
+		"to the event loops by their number\nof source interfaces.\n");
+	fprintf(stderr, "All open M-PDUs are sent on demand when receiving "
+		"SIGUSR1.\n");
+	fprintf(stderr, "Instead of CAN interfaces fd:<n> (inherited socket) "
+		"and unix:<path> AF_UNIX\nSOCK_SEQPACKET transports can "
+		"be used (no CAN filters).\n");
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* add (on != 0) or remove the socket of the port in the epoll set */
+static void port_watch(struct gw_loop *l, struct gw_port *port, int on,
+		       __u32 events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = port };
+
+	if (epoll_ctl(l->efd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, port->s,
+		      &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+/* report dropped input - the daemon goes on with the next frame */
+static void drop_log(struct gw_pipe *p, struct gw_port *src,
+		     const char *fmt, ...)
+{
+	__u64 now = now_ns();
+	va_list ap;
+
+	if (now - p->log_start >= LOG_INTERVAL_NS) {
+		if (p->log_missed)
+			fprintf(stderr, "line %u: %u drop messages "
+				"suppressed\n", p->line, p->log_missed);
+		p->log_start = now;
+		p->log_cnt = 0;
+		p->log_missed = 0;
+	}
+
+	if (p->log_cnt == LOG_BURST) {
+		p->log_missed++;
+		return;
+	}
+	p->log_cnt++;
+
+	fprintf(stderr, "%s: ", src->name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* send the pending frames until the destination blocks again */
+static void tx_flush(struct gw_pipe *p)
+{
+	if (tx_dst_flush(&p->tx) < 0) {
+		perror("write dst canxl_frame");
+		exit(1);
+	}
+}
+
+/* send without blocking the event loop - queue while dst is blocked */
+static void tx_send(struct gw_pipe *p, struct canxl_frame *cfx)
+{
+	/* the reception is paused before the queue can get full */
+	if (tx_dst_send(&p->tx, cfx) < 0) {
+		perror("write dst canxl_frame");
+		exit(1);
+	}
+}
+
+/* block until all pending frames are sent (termination only) */
+static void tx_drain(struct gw_pipe *p)
+{
+	while (tx_flush(p), txq_len(&p->tx.q))
+		tx_wait(p->dst.s, p->tx.q.err);
+}
+
+/*
+ * Wait for EPOLLOUT while dst is blocked (ENOBUFS is retried by the timer)
+ * and pause the reception while the queue can not take the frames that
+ * are produced by one received frame.
+ */
+static void pipe_update_io(struct gw_pipe *p)
+{
+	int polled = txq_len(&p->tx.q) && p->tx.q.err != ENOBUFS;
+	int paused = p->tx.q.size - txq_len(&p->tx.q) < p->txq_room;
+	unsigned int i;
+
+	if (polled != p->dst_polled) {
+		port_watch(p->loop, &p->dst, polled, EPOLLOUT);
+		p->dst_polled = polled;
+	}
+
+	if (paused != p->paused) {
+		for (i = 0; i < p->nsrcs; i++)
+			if (!p->srcs[i].closed)
+				port_watch(p->loop, &p->srcs[i], !paused,
+					   EPOLLIN);
+		p->paused = paused;
+	}
+}
+
+/* send out the M-PDU and stop its timeout */
+static void stream_flush(struct gw_pipe *p, struct gw_stream *st, int reason)
+{
+	mpdu_finish(&st->mb, &st->cf, reason, p->mpdu_max_size, p->metrics);
+
+	tx_send(p, &st->cf);
+
+	mpdu_init(&st->mb, st->cf.data, p->mpdu_max_size);
+	tw_del(p->wheel, &st->timer);
+}
+
+/* open M-PDU with the earliest deadline (NULL = none or decompose) */
+static struct gw_stream *stream_first(struct gw_pipe *p)
+{
+	struct tw_timer *t = p->wheel ? tw_first(p->wheel) : NULL;
+
+	return t ? tw_entry(t, struct gw_stream, timer) : NULL;
+}
+
+/* send out the open M-PDUs as long as the queue takes them */
+static void flush_all(struct gw_pipe *p, int reason)
+{
+	struct gw_stream *st;
+
+	while (!txq_full(&p->tx.q) && (st = stream_first(p)))
+		stream_flush(p, st, reason);
+}
+
+static void compose_frame(struct gw_pipe *p, struct gw_port *src,
+			  struct canxl_frame *cfsrc)
+{
+	struct gw_stream *st;
+	struct cpdu c;
+	unsigned int i;
+	__u64 now;
+	int ret;
+
+	/* fd:/unix: transports have no CAN filters */
+	for (i = 0; i < p->ntids; i++)
+		if ((cfsrc->prio & CANXL_PRIO_MASK) == p->tids[i])
+			break;
+
+	if (i == p->ntids)
+		return;
+
+	/* does the new PDU generally fit into the C-PDU space? */
+	if (cpdu_oversize(cfsrc->len, p->mpdu_max_size, p->metrics)) {
+		drop_log(p, src, "dropped C-PDU (exceeds the M-PDU size "
+			 "limit)");
+		return;
+	}
+
+	if (p->per_vcid)
+		i += (src - p->srcs) * p->ntids;
+	st = &p->streams[i];
+
+	/* no space left => send out the current M-PDU to make space */
+	if (st->mb.len && !mpdu_fits(&st->mb, cfsrc->len))
+		stream_flush(p, st, METRICS_BUFFER);
+
+	if (!st->mb.len) {
+		/* start timeout when adding the first C-PDU element */
+		now = now_ns();
+		st->deadline = now + p->timeout_ms * 1000000ULL;
+		tw_add(p->wheel, &st->timer, st->deadline, now);
+	}
+
+	cpdu_compose(&c, (struct canxl_hdr *)cfsrc, src->vcid, cfsrc->data);
+
+	/* paranoia check - the space has been checked before */
+	ret = mpdu_append(&st->mb, &c);
+	if (ret < 0) {
+		fprintf(stderr, "%s: failure: %s!\n", src->name,
+			mpdu_strerror(ret));
+		exit(1);
+	}
+
+	/* limit the number of C-PDUs waiting in the M-PDU */
+	if (st->mb.ncpdus == p->max_cpdus)
+		stream_flush(p, st, METRICS_COUNT);
+}
+
+static void decompose_frame(struct gw_pipe *p, struct gw_port *src,
+			    struct canxl_frame *rxf)
+{
+	struct canxl_frame txf;
+	struct mpdu_iter it;
+	struct cpdu c;
+	unsigned int cpducnt = 0;
+	const char *err;
+	int ret;
+
+	/* fd:/unix: transports have no CAN filters */
+	if ((rxf->prio & CANXL_PRIO_MASK) != p->tids[0])
+		return;
+
+	/* no M-PDU or beyond the M-PDU max size limit */
+	err = mpdu_check((struct canxl_hdr *)rxf, p->mpdu_max_size,
+			 p->metrics);
+	if (err) {
+		drop_log(p, src, "dropped frame (%s)", err);
+		return;
+	}
+
+	ret = mpdu_iter_init(&it, rxf->data, rxf->len);
+	if (ret < 0) {
+		p->metrics->drop_invalid++;
+		drop_log(p, src, "dropped M-PDU (%s, length %u)",
+			 mpdu_strerror(ret), rxf->len);
+		return;
+	}
+
+	while ((ret = mpdu_iter_next(&it, &c)) > 0) {
+		/* create a valid STD frame from this C-PDU element */
+		cpdu_frame(&txf, &c, p->tids[0]);
+
+		p->metrics->frames_out++;
+		p->metrics->bytes_out += CANXL_HDR_SIZE + txf.len;
+		tx_send(p, &txf);
+		cpducnt++;
+	}
+
+	/* the C-PDUs in front of the broken one are sent already */
+	if (ret < 0) {
+		p->metrics->drop_invalid++;
+		drop_log(p, src, "dropped rest of M-PDU (%s, offset %u)",
+			 mpdu_strerror(ret), it.pos);
+		return;
+	}
+
+	metrics_mpdu(p->metrics, rxf->len, p->mpdu_max_size, cpducnt);
+}
+
+/* send out everything of the pipeline and stop it */
+static void pipe_finish(struct gw_pipe *p)
+{
+	struct gw_stream *st;
+	unsigned int i;
+
+	while ((st = stream_first(p))) {
+		if (txq_full(&p->tx.q))
+			tx_drain(p);
+		stream_flush(p, st, METRICS_EXIT);
+	}
+
+	tx_drain(p);
+
+	/* no more events for this pipeline */
+	if (p->dst_polled)
+		port_watch(p->loop, &p->dst, 0, 0);
+
+	/* the end of a transport connection is passed on to the peer */
+	for (i = 0; i < p->nsrcs; i++) {
+		if (!p->paused && !p->srcs[i].closed)
+			port_watch(p->loop, &p->srcs[i], 0, 0);
+		close(p->srcs[i].s);
+	}
+	close(p->dst.s);
+
+	p->done = 1;
+	p->loop->nrunning--;
+}
+
+/* the peer of a fd:/unix: transport has closed the connection */
+static void src_closed(struct gw_pipe *p, struct gw_port *src)
+{
+	if (!p->paused)
+		port_watch(p->loop, src, 0, 0);
+
+	src->closed = 1;
+	if (!--p->nopen)
+		pipe_finish(p);
+}
+
+static void read_src(struct gw_pipe *p, struct gw_port *src)
+{
+	struct canxl_frame cf;
+	char ctrlmsg[CTRLMSG_SIZE];
+	struct iovec iov;
+	struct msghdr msg;
+	unsigned int n;
+	const char *err;
+	__u32 ndrops;
+	int nbytes;
+
+	for (n = 0; n < RX_BUDGET && !p->paused && !p->done; n++) {
+		iov.iov_base = &cf;
+		iov.iov_len = sizeof(cf);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrlmsg;
+		msg.msg_controllen = sizeof(ctrlmsg);
+
+		nbytes = recvmsg(src->s, &msg, MSG_DONTWAIT);
+		p->metrics->syscalls++;
+		if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				break;
+
+			perror("read");
+			exit(1);
+		}
+
+		if (!nbytes) {
+			src_closed(p, src);
+			break;
+		}
+
+		ndrops = transport_drops(&msg, &src->drops);
+		if (ndrops) {
+			p->metrics->drop_rxq += ndrops;
+			drop_log(p, src, "%u frames dropped (socket receive "
+				 "queue overflow)", ndrops);
+		}
+
+		err = frame_check((struct canxl_hdr *)&cf, nbytes);
+		if (err) {
+			p->metrics->drop_invalid++;
+			drop_log(p, src, "dropped frame (%s)", err);
+			continue;
+		}
+
+		p->metrics->frames_in++;
+		p->metrics->bytes_in += nbytes;
+
+		if (p->type == PIPE_COMPOSE)
+			compose_frame(p, src, &cf);
+		else
+			decompose_frame(p, src, &cf);
+
+		pipe_update_io(p);
+	}
+}
+
+/* next timeout of the pipeline (0 = none) */
+static __u64 pipe_deadline(struct gw_pipe *p)
+{
+	/* no M-PDU timeouts while blocked - only the ENOBUFS retry */
+	if (txq_len(&p->tx.q))
+		return p->tx.q.err == ENOBUFS ? p->tx.retry : 0;
+
+	if (p->wheel && !tw_empty(p->wheel))
+		return tw_next(p->wheel);
+
+	return 0;
+}
+
+static void loop_timeouts(struct gw_loop *l)
+{
+	struct gw_pipe *p;
+	struct gw_stream *st;
+	struct tw_timer *t;
+	__u64 now = now_ns();
+	unsigned int i;
+
+	for (i = 0; i < l->npipes; i++) {
+		p = l->pipes[i];
+		if (p->done)
+			continue;
+
+		if (txq_len(&p->tx.q) && p->tx.q.err == ENOBUFS &&
+		    p->tx.retry <= now)
+			tx_flush(p);
+
+		while (p->wheel && !txq_len(&p->tx.q) &&
+		       (t = tw_expire(p->wheel, now))) {
+			st = tw_entry(t, struct gw_stream, timer);
+			metrics_late(p->metrics, now - st->deadline);
+			stream_flush(p, st, METRICS_TIMEOUT);
+		}
+
+		pipe_update_io(p);
+	}
+}
+
+/* (re)arm the timer for the earliest deadline of all pipelines */
+static void loop_update_timer(struct gw_loop *l)
+{
+	struct itimerspec spec;
+	__u64 deadline = 0, d;
+	unsigned int i;
+
+	for (i = 0; i < l->npipes; i++) {
+		if (l->pipes[i]->done)
+			continue;
+
+		d = pipe_deadline(l->pipes[i]);
+		if (d && (!deadline || d < deadline))
+			deadline = d;
+	}
+
+	if (deadline == l->timer_deadline)
+		return;
+
+	/* a zero timeout value stops the timer */
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = deadline / 1000000000ULL;
+	spec.it_value.tv_nsec = deadline % 1000000000ULL;
+	timerfd_settime(l->timer.s, TFD_TIMER_ABSTIME, &spec, NULL);
+	l->timer_deadline = deadline;
+}
+
+/* requests of the main thread */
+static void loop_wake(struct gw_loop *l)
+{
+	struct gw_pipe *p;
+	unsigned int i;
+
+	if (__atomic_exchange_n(&l->demand, 0, __ATOMIC_ACQ_REL)) {
+		for (i = 0; i < l->npipes; i++) {
+			p = l->pipes[i];
+			if (!p->done) {
+				flush_all(p, METRICS_DEMAND);
+				pipe_update_io(p);
+			}
+		}
+	}
+
+	if (__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < l->npipes; i++)
+			if (!l->pipes[i]->done)
+				pipe_finish(l->pipes[i]);
+	}
+}
+
+static void *loop_run(void *arg)
+{
+	struct gw_loop *l = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct gw_port *port;
+	__u64 val;
+	int n, i;
+
+	while (l->nrunning) {
+		loop_update_timer(l);
+
+		n = epoll_wait(l->efd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			port = events[i].data.ptr;
+
+			switch (port->type) {
+			case PORT_SRC:
+				/* stale event of a paused or finished pipeline */
+				if (!port->p->paused && !port->p->done &&
+				    !port->closed)
+					read_src(port->p, port);
+				break;
+
+			case PORT_DST:
+				if (!port->p->done) {
+					tx_flush(port->p);
+					pipe_update_io(port->p);
+				}
+				break;
+
+			case PORT_TIMER:
+				if (read(port->s, &val, sizeof(val)) < 0 &&
+				    errno != EAGAIN) {
+					perror("read timerfd");
+					exit(1);
+				}
+				loop_timeouts(l);
+				break;
+
+			case PORT_WAKE:
+				if (read(port->s, &val, sizeof(val)) < 0) {
+					perror("read eventfd");
+					exit(1);
+				}
+				loop_wake(l);
+				break;
+			}
+		}
+	}
+
+	/* tell the main thread */
+	val = 1;
+	if (write(done_fd, &val, sizeof(val)) < 0)
+		perror("write eventfd");
+
+	return NULL;
+}
+
+static int open_can(const char *name, struct can_filter *rfilter,
+		    unsigned int nfilters)
+{
+	struct sockaddr_can addr;
+	int sockopt = 1;
+	int s;
+
+	if (strlen(name) >= IFNAMSIZ) {
+		fprintf(stderr, "Name of CAN device '%s' is too long!\n", name);
+		return -1;
+	}
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* enable CAN XL frames */
+	if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_XL_FRAMES, &sockopt,
+		       sizeof(sockopt)) < 0) {
+		perror("sockopt CAN_RAW_XL_FRAMES");
+		close(s);
+		return -1;
+	}
+
+	/* filter only for transfer_ids (= prio_id) - no filter: no reception */
+	if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, nfilters ? rfilter : NULL,
+		       nfilters * sizeof(rfilter[0])) < 0) {
+		perror("sockopt CAN_RAW_FILTER");
+		close(s);
+		return -1;
+	}
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(name);
+	if (!addr.can_ifindex) {
+		fprintf(stderr, "No CAN device '%s'!\n", name);
+		close(s);
+		return -1;
+	}
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static int open_port(struct gw_port *port, struct can_filter *rfilter,
+		     unsigned int nfilters)
+{
+	if (transport_is_can(port->name))
+		port->s = open_can(port->name, rfilter, nfilters);
+	else
+		port->s = transport_open(port->name);
+
+	return port->s < 0 ? -1 : 0;
+}
+
+/* open the sockets and buffers of the pipeline */
+static int pipe_open(struct gw_pipe *p)
+{
+	struct can_filter rfilter[MAX_TRANSFER_IDS];
+	unsigned int i, nstreams;
+
+	for (i = 0; i < p->ntids; i++) {
+		rfilter[i].can_id = p->tids[i];
+		rfilter[i].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+			CAN_SFF_MASK;
+	}
+
+	for (i = 0; i < p->nsrcs; i++) {
+		if (open_port(&p->srcs[i], rfilter, p->ntids) < 0 ||
+		    transport_drops_enable(p->srcs[i].s) < 0)
+			return -1;
+	}
+	p->nopen = p->nsrcs;
+
+	if (open_port(&p->dst, NULL, 0) < 0)
+		return -1;
+
+	p->metrics = &p->local_metrics;
+	if (p->metrics_name) {
+		p->metrics = metrics_open(p->metrics_name,
+					  p->type == PIPE_COMPOSE ?
+					  "sdt2mpdu" : "mpdu2sdt");
+		if (!p->metrics)
+			return -1;
+	}
+
+	if (p->type == PIPE_COMPOSE) {
+		nstreams = p->per_vcid ? p->nsrcs * p->ntids : p->ntids;
+		p->streams = calloc(nstreams, sizeof(*p->streams));
+		p->wheel = malloc(sizeof(*p->wheel));
+		if (!p->streams || !p->wheel) {
+			perror("calloc");
+			return -1;
+		}
+
+		for (i = 0; i < nstreams; i++)
+			mpdu_start(&p->streams[i].mb, &p->streams[i].cf,
+				   p->tids[i % p->ntids], p->mpdu_max_size);
+		tw_init(p->wheel);
+
+		/* buffer full and count trigger for the same M-PDU */
+		p->txq_room = 2;
+	} else {
+		p->txq_room = MPDU_MAX_C_PDUS;
+	}
+
+	if (txq_create(&p->tx.q, p->type == PIPE_COMPOSE ?
+		       TXQ_DEFAULT_SIZE : DECOMPOSE_TXQ_SIZE) < 0) {
+		perror("calloc");
+		return -1;
+	}
+	p->tx.s = p->dst.s;
+	p->tx.clock = now_ns;
+	p->tx.metrics = p->metrics;
+
+	return 0;
+}
+
+static int parse_pipe(char *line, const char *path, unsigned int lineno)
+{
+	char *argv[MAX_ARGS + 1];
+	struct gw_pipe *p;
+	struct gw_port *src;
+	canid_t transfer_id;
+	char *tok, *save, *vcid;
+	int argc = 0;
+	int opt, i;
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok && *tok != '#';
+	     tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (argc == MAX_ARGS) {
+			fprintf(stderr, "%s:%u: too many arguments\n", path,
+				lineno);
+			return -1;
+		}
+		argv[argc++] = tok;
+	}
+	argv[argc] = NULL;
+
+	if (!argc)
+		return 0;
+
+	if (npipes == MAX_PIPES) {
+		fprintf(stderr, "%s:%u: more than %d pipelines\n", path,
+			lineno, MAX_PIPES);
+		return -1;
+	}
+
+	p = &pipes[npipes];
+	p->line = lineno;
+	p->cpu = -1;
+	p->mpdu_max_size = MPDU_DEFAULT_SIZE;
+	p->timeout_ms = MPDU_DEFAULT_TIMEOUT_MS;
+
+	if (!strcmp(argv[0], "compose"))
+		p->type = PIPE_COMPOSE;
+	else if (!strcmp(argv[0], "decompose"))
+		p->type = PIPE_DECOMPOSE;
+	else {
+		fprintf(stderr, "%s:%u: unknown pipeline '%s'\n", path,
+			lineno, argv[0]);
+		return -1;
+	}
+
+	/* reinitialize getopt() for each line */
+	optind = 0;
+	while ((opt = getopt(argc, argv, "t:l:T:n:eC:M:")) != -1) {
+		switch (opt) {
+		case 't':
+			transfer_id = strtoul(optarg, NULL, 16);
+			if (transfer_id & ~CANXL_PRIO_MASK ||
+			    p->ntids >= MAX_TRANSFER_IDS)
+				goto invalid;
+
+			/* mpdu2sdt: the last -t option counts */
+			if (p->type == PIPE_DECOMPOSE)
+				p->ntids = 0;
+			p->tids[p->ntids++] = transfer_id;
+			break;
+
+		case 'l':
+			p->mpdu_max_size = strtoul(optarg, NULL, 10);
+			if (p->mpdu_max_size < MPDU_MIN_SIZE ||
+			    p->mpdu_max_size > MPDU_MAX_SIZE ||
+			    p->mpdu_max_size % 4)
+				goto invalid;
+			break;
+
+		case 'T':
+			if (p->type != PIPE_COMPOSE)
+				goto invalid;
+			p->timeout_ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			if (p->type != PIPE_COMPOSE)
+				goto invalid;
+			p->max_cpdus = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'e':
+			if (p->type != PIPE_COMPOSE)
+				goto invalid;
+			p->per_vcid = 1;
+			break;
+
+		case 'C':
+			p->cpu = strtoul(optarg, NULL, 10);
+			if (p->cpu >= CPU_SETSIZE)
+				goto invalid;
+			break;
+
+		case 'M':
+			p->metrics_name = optarg;
+			break;
+
+		default:
+			goto invalid;
+		}
+	}
+
+	if (!p->ntids)
+		p->tids[p->ntids++] = DEFAULT_TRANSFER_ID;
+
+	/* src_if[:vcid] list and dst_if */
+	if (argc - optind < 2 ||
+	    (p->type == PIPE_COMPOSE && argc - optind > MAX_SRC_IF + 1) ||
+	    (p->type == PIPE_DECOMPOSE && argc - optind != 2))
+		goto invalid;
+
+	for (i = optind; i < argc - 1; i++) {
+		src = &p->srcs[p->nsrcs];
+		src->type = PORT_SRC;
+		src->p = p;
+		src->name = argv[i];
+		src->vcid = DEFAULT_VCID + p->nsrcs;
+
+		vcid = strchr(argv[i] + transport_prefix(argv[i]), ':');
+		if (vcid && p->type == PIPE_COMPOSE) {
+			*vcid++ = 0;
+			src->vcid = strtoul(vcid, NULL, 16);
+		}
+		p->nsrcs++;
+	}
+
+	p->dst.type = PORT_DST;
+	p->dst.p = p;
+	p->dst.name = argv[argc - 1];
+
+	npipes++;
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s:%u: invalid %s pipeline\n", path, lineno, argv[0]);
+	return -1;
+}
+
+static int parse_config(const char *path)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	unsigned int lineno = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (getline(&line, &len, f) >= 0) {
+		lineno++;
+		if (parse_pipe(line, path, lineno) < 0) {
+			fclose(f);
+			return -1;
+		}
+
+		/* the pipelines refer to the names in the line */
+		line = NULL;
+		len = 0;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!npipes) {
+		fprintf(stderr, "%s: no pipelines\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* CPU list like 0-3,6 */
+static int parse_cpus(char *arg, cpu_set_t *set)
+{
+	unsigned long from, to;
+	char *tok, *end;
+
+	CPU_ZERO(set);
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		from = to = strtoul(tok, &end, 10);
+		if (end != tok && *end == '-')
+			to = strtoul(end + 1, &end, 10);
+
+		if (end == tok || *end || from > to || to >= CPU_SETSIZE)
+			return -1;
+
+		while (from <= to)
+			CPU_SET(from++, set);
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* distribute the pipelines to the event loops */
+static int assign_pipes(void)
+{
+	struct gw_loop *l;
+	struct gw_pipe *p;
+	unsigned int i, j;
+
+	for (i = 0; i < npipes; i++) {
+		p = &pipes[i];
+		l = NULL;
+
+		for (j = 0; j < nloops; j++) {
+			if (p->cpu >= 0) {
+				if (loops[j].cpu == p->cpu) {
+					l = &loops[j];
+					break;
+				}
+			} else if (!l || loops[j].weight < l->weight) {
+				l = &loops[j];
+			}
+		}
+
+		if (!l) {
+			fprintf(stderr, "pipeline of line %u: CPU %d is not "
+				"in the CPU list\n", p->line, p->cpu);
+			return -1;
+		}
+
+		p->loop = l;
+		l->pipes[l->npipes++] = p;
+		l->weight += p->nsrcs;
+
+		if (verbose)
+			printf("line %u: %s %s%s -> %s on CPU %d\n", p->line,
+			       p->type == PIPE_COMPOSE ? "compose" : "decompose",
+			       p->srcs[0].name, p->nsrcs > 1 ? " ..." : "",
+			       p->dst.name, l->cpu);
+	}
+
+	return 0;
+}
+
+static int loop_open(struct gw_loop *l)
+{
+	unsigned int i, j;
+	struct gw_pipe *p;
+
+	l->efd = epoll_create1(0);
+	if (l->efd < 0) {
+		perror("epoll_create");
+		return -1;
+	}
+
+	l->timer.type = PORT_TIMER;
+	l->timer.s = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (l->timer.s < 0) {
+		perror("timerfd");
+		return -1;
+	}
+
+	l->wake.type = PORT_WAKE;
+	l->wake.s = eventfd(0, 0);
+	if (l->wake.s < 0) {
+		perror("eventfd");
+		return -1;
+	}
+
+	port_watch(l, &l->timer, 1, EPOLLIN);
+	port_watch(l, &l->wake, 1, EPOLLIN);
+
+	for (i = 0; i < l->npipes; i++) {
+		p = l->pipes[i];
+		if (pipe_open(p) < 0)
+			return -1;
+
+		for (j = 0; j < p->nsrcs; j++)
+			port_watch(l, &p->srcs[j], 1, EPOLLIN);
+	}
+	l->nrunning = l->npipes;
+
+	return 0;
+}
+
+static int loop_start(struct gw_loop *l)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret;
+
+	CPU_ZERO(&set);
+	CPU_SET(l->cpu, &set);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	ret = pthread_create(&l->tid, &attr, loop_run, l);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		fprintf(stderr, "event loop on CPU %d: %s\n", l->cpu,
+			strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* pass a request (demand or stop) to all running event loops */
+static void wake_loops(int stop)
+{
+	__u64 val = 1;
+	unsigned int i;
+
+	for (i = 0; i < nloops; i++) {
+		if (!loops[i].npipes)
+			continue;
+
+		__atomic_store_n(stop ? &loops[i].stop : &loops[i].demand, 1,
+				 __ATOMIC_RELEASE);
+		if (write(loops[i].wake.s, &val, sizeof(val)) < 0)
+			perror("write eventfd");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	sigset_t sigmask;
+	cpu_set_t cpus;
+	unsigned int i, running = 0;
+	int opt, cpu, cpus_set = 0;
+	int rt_prio = 0, rt_cpu; /* real-time mode (0 = off) */
+	__u64 val;
+
+	while ((opt = getopt(argc, argv, "C:P:vh?")) != -1) {
+		switch (opt) {
+		case 'C':
+			if (parse_cpus(optarg, &cpus) < 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			cpus_set = 1;
+			break;
+
+		case 'P':
+			/* the event loops are pinned to their CPUs anyway */
+			if (rt_parse(optarg, &rt_prio, &rt_cpu) < 0 ||
+			    rt_cpu >= 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	if (parse_config(argv[optind]) < 0)
+		return 1;
+
+	if (!cpus_set && sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+		perror("sched_getaffinity");
+		return 1;
+	}
+
+	/* one event loop per CPU */
+	loops = calloc(CPU_COUNT(&cpus), sizeof(*loops));
+	if (!loops) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &cpus))
+			loops[nloops++].cpu = cpu;
+
+	if (assign_pipes() < 0)
+		return 1;
+
+	for (i = 0; i < nloops; i++)
+		if (loops[i].npipes && loop_open(&loops[i]) < 0)
+			return 1;
+
+	/* all buffers are allocated - the event loops inherit SCHED_FIFO */
+	if (rt_prio && rt_enable(rt_prio, -1) < 0)
+		return 1;
+
+	/* the event loops inherit the blocked signals */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+		perror("sigprocmask");
+		return 1;
+	}
+
+	pfd[0].fd = signalfd(-1, &sigmask, 0);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = done_fd = eventfd(0, 0);
+	pfd[1].events = POLLIN;
+	if (pfd[0].fd < 0 || pfd[1].fd < 0) {
+		perror("signalfd/eventfd");
+		return 1;
+	}
+
+	for (i = 0; i < nloops; i++) {
+		if (!loops[i].npipes)
+			continue;
+
+		if (loop_start(&loops[i]) < 0)
+			return 1;
+		running++;
+	}
+
+	/* signals and terminated event loops */
+	while (running) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(pfd[0].fd, &si, sizeof(si)) != sizeof(si)) {
+				perror("read signalfd");
+				return 1;
+			}
+
+			wake_loops(si.ssi_signo != SIGUSR1);
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			if (read(pfd[1].fd, &val, sizeof(val)) != sizeof(val)) {
+				perror("read eventfd");
+				return 1;
+			}
+			running -= val;
+		}
+	}
+
+	for (i = 0; i < nloops; i++)
+		if (loops[i].npipes)
+			pthread_join(loops[i].tid, NULL);
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * mpduharness.c - end-to-end throughput and latency test without vcan
+ *
+ * generator -> sdt2mpdu -> mpdu2sdt -> checker
+ *
+ * The tools run as child processes that are connected with AF_UNIX
+ * SOCK_SEQPACKET socketpairs (fd:<n> transports).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <linux/can.h>
+
+#include "cia-611-2.h"
+#include "dwelltime.h"
+
+#define DEFAULT_COUNT 100000
+#define DEFAULT_FROM 1
+#define DEFAULT_TO 64
+#define TEST_SDT 0x03
+#define IDLE_MS 100 /* request on demand sending after idle time */
+#define IDLE_MAX 50 /* give up after IDLE_MAX * IDLE_MS */
+#define MAX_ARGS 32
+
+extern int optind, opterr, optopt;
+
+struct generator {
+	int s;
+	unsigned int count;
+	unsigned int from;
+	unsigned int to;
+	unsigned long gap_us;
+	__u64 *txstamps; /* send time of each frame */
+	__u64 start;
+	__u64 end;
+};
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "%s - end-to-end test of sdt2mpdu and mpdu2sdt "
+		"without vcan\n\n", prg);
+	fprintf(stderr, "Usage: %s [options]\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -n <count>     (number of CAN XL frames "
+		"- default: %d)\n", DEFAULT_COUNT);
+	fprintf(stderr, "         -l <from>:<to> (length of CAN XL frames "
+		"- default: %d to %d)\n", DEFAULT_FROM, DEFAULT_TO);
+	fprintf(stderr, "         -g <us>        (gap between frames in micro "
+		"seconds - default: 0)\n");
+	fprintf(stderr, "         -c <options>   (sdt2mpdu options)\n");
+	fprintf(stderr, "         -d <options>   (mpdu2sdt options)\n");
+	fprintf(stderr, "         -p <dir>       (directory of the tools "
+		"- default: directory of %s)\n", prg);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The received frames are checked for their sequence "
+		"number (AF), length\nand data. The exit code is 1 when not "
+		"all frames are received intact.\n");
+}
+
+/* the content of each frame is defined by its sequence number */
+static void fill_frame(struct canxl_frame *cfx, unsigned int seq,
+		       unsigned int from, unsigned int to)
+{
+	unsigned int i;
+
+	cfx->prio = DEFAULT_TRANSFER_ID;
+	cfx->flags = CANXL_XLF;
+	cfx->sdt = TEST_SDT;
+	cfx->af = seq;
+	cfx->len = from + (seq * 2654435761U >> 8) % (to - from + 1);
+
+	for (i = 0; i < cfx->len; i++)
+		cfx->data[i] = (seq + i) & 0xFFU;
+}
+
+static void *generator(void *arg)
+{
+	struct generator *gen = arg;
+	struct canxl_frame cfx;
+	unsigned int seq;
+
+	gen->start = dwell_now();
+
+	for (seq = 0; seq < gen->count; seq++) {
+		fill_frame(&cfx, seq, gen->from, gen->to);
+
+		gen->txstamps[seq] = dwell_now();
+		if (write(gen->s, &cfx, CANXL_HDR_SIZE + cfx.len) !=
+		    CANXL_HDR_SIZE + cfx.len) {
+			perror("generator write");
+			exit(1);
+		}
+
+		if (gen->gap_us)
+			usleep(gen->gap_us);
+	}
+
+	gen->end = dwell_now();
+
+	return NULL;
+}
+
+/* start a tool with the given options and fd:<n> transports */
+static pid_t start_tool(char *dir, char *tool, char *opts, int src, int dst,
+			int *keep, int nkeep)
+{
+	char path[1024], srcname[16], dstname[16];
+	char *argv[MAX_ARGS + 4];
+	int argc = 0, i;
+	pid_t pid;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, tool);
+	snprintf(srcname, sizeof(srcname), "fd:%d", src);
+	snprintf(dstname, sizeof(dstname), "fd:%d", dst);
+
+	argv[argc++] = path;
+	for (opts = strtok(opts, " "); opts && argc <= MAX_ARGS;
+	     opts = strtok(NULL, " "))
+		argv[argc++] = opts;
+	argv[argc++] = srcname;
+	argv[argc++] = dstname;
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (pid)
+		return pid;
+
+	/* close the sockets of the other processes */
+	for (i = 0; i < nkeep; i++)
+		if (keep[i] != src && keep[i] != dst)
+			close(keep[i]);
+
+	execv(path, argv);
+	perror(path);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	struct generator gen = {
+		.count = DEFAULT_COUNT,
+		.from = DEFAULT_FROM,
+		.to = DEFAULT_TO,
+	};
+	char *copts = strdup(""), *dopts = strdup("");
+	char *dir = NULL;
+
+	int sp[3][2]; /* gen-sdt2mpdu, sdt2mpdu-mpdu2sdt, mpdu2sdt-checker */
+	int fds[6];
+	pid_t composer, decomposer;
+	pthread_t thread;
+	struct dwell_stats lat = { 0 };
+	struct dwell_hist *h;
+	struct canxl_frame cfx, exp;
+	struct pollfd pfd;
+	__u8 *received;
+	unsigned int nrecv = 0, errors = 0, reordered = 0, idle = 0;
+	unsigned int next = 0; /* next expected sequence number */
+	__u64 now, last = 0;
+	double secs;
+	int nbytes, sndbuf = 1 << 20, i;
+
+	while ((opt = getopt(argc, argv, "n:l:g:c:d:p:h?")) != -1) {
+		switch (opt) {
+
+		case 'n':
+			gen.count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			if (sscanf(optarg, "%u:%u", &gen.from, &gen.to) != 2 ||
+			    gen.from < CANXL_MIN_DLEN || gen.to > CANXL_MAX_DLEN ||
+			    gen.from > gen.to) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'g':
+			gen.gap_us = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			copts = optarg;
+			break;
+
+		case 'd':
+			dopts = optarg;
+			break;
+
+		case 'p':
+			dir = optarg;
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
+	}
+
+	if (!gen.count) {
+		print_usage(basename(argv[0]));
+		return 1;
+	}
+
+	if (!dir)
+		dir = dirname(strdup(argv[0]));
+
+	gen.txstamps = calloc(gen.count, sizeof(__u64));
+	received = calloc(gen.count, 1);
+	if (!gen.txstamps || !received) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sp[i]) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		setsockopt(sp[i][0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			   sizeof(sndbuf));
+		setsockopt(sp[i][1], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			   sizeof(sndbuf));
+		fds[2 * i] = sp[i][0];
+		fds[2 * i + 1] = sp[i][1];
+	}
+
+	composer = start_tool(dir, "sdt2mpdu", copts, sp[0][1], sp[1][0],
+			      fds, 6);
+	decomposer = start_tool(dir, "mpdu2sdt", dopts, sp[1][1], sp[2][0],
+				fds, 6);
+
+	close(sp[0][1]);
+	close(sp[1][0]);
+	close(sp[1][1]);
+	close(sp[2][0]);
+
+	gen.s = sp[0][0];
+	if (pthread_create(&thread, NULL, generator, &gen)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	/* checker */
+	pfd.fd = sp[2][1];
+	pfd.events = POLLIN;
+
+	while (nrecv + errors < gen.count) {
+		if (poll(&pfd, 1, IDLE_MS) == 0) {
+			/* send out the pending C-PDUs on demand */
+			if (++idle > IDLE_MAX)
+				break;
+			kill(composer, SIGUSR1);
+			continue;
+		}
+
+		nbytes = read(sp[2][1], &cfx, sizeof(cfx));
+		if (nbytes <= 0) {
+			perror("checker read");
+			break;
+		}
+		now = dwell_now();
+		idle = 0;
+
+		/* the sequence number (AF) defines the expected content */
+		if (cfx.af < gen.count)
+			fill_frame(&exp, cfx.af, gen.from, gen.to);
+
+		if (cfx.af >= gen.count || received[cfx.af] ||
+		    nbytes != CANXL_HDR_SIZE + exp.len ||
+		    cfx.sdt != exp.sdt || cfx.len != exp.len ||
+		    memcmp(cfx.data, exp.data, exp.len)) {
+			if (!errors)
+				fprintf(stderr, "corrupted or duplicated frame "
+					"(af %u len %u)\n", cfx.af, cfx.len);
+			errors++;
+			continue;
+		}
+
+		/* C-PDUs may be reordered by bin packing (sdt2mpdu -p) */
+		if (cfx.af < next)
+			reordered++;
+		else
+			next = cfx.af + 1;
+
+		received[cfx.af] = 1;
+		dwell_add(&lat, 0, now - gen.txstamps[cfx.af]);
+		last = now;
+		nrecv++;
+	}
+
+	kill(composer, SIGTERM);
+	kill(decomposer, SIGTERM);
+	pthread_join(thread, NULL);
+	waitpid(composer, NULL, 0);
+	waitpid(decomposer, NULL, 0);
+
+	h = lat.sdt[0];
+	secs = (last > gen.start ? last - gen.start : 1) / 1e9;
+
+	printf("frames sent %u received %u reordered %u errors %u lost %u\n",
+	       gen.count, nrecv, reordered, errors,
+	       gen.count - nrecv - errors);
+	printf("throughput %.0f frames/s (generator %.0f frames/s)\n",
+	       nrecv / secs, gen.count / ((gen.end - gen.start) / 1e9));
+	if (h)
+		printf("latency min %.1fus p50 %.1fus p99 %.1fus "
+		       "max %.1fus\n", h->min / 1000.0,
+		       dwell_percentile(h, 50) / 1000.0,
+		       dwell_percentile(h, 99) / 1000.0, h->max / 1000.0);
+
+	return (nrecv != gen.count) ? 1 : 0;
+}
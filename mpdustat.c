@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * mpdustat.c - display the counters of sdt2mpdu and mpdu2sdt
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+#include "metrics.h"
+
+extern int optind, opterr, optopt;
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "%s - display the counters of sdt2mpdu and mpdu2sdt\n\n", prg);
+	fprintf(stderr, "Usage: %s [options] <name>\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -i <ms>  (repeat display every <ms> milli "
+		"seconds)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<name> is the shared memory object given with the "
+		"-M option of the tools.\n");
+}
+
+static void print_metrics(struct mpdu_metrics *m)
+{
+	struct mpdu_metrics c;
+	__u64 frames, late;
+	int i;
+
+	/* take a snapshot of the counters */
+	memcpy(&c, m, sizeof(c));
+	frames = c.frames_in + c.frames_out;
+
+	printf("%s:\n", c.tool);
+	printf("  frames in %llu (%llu bytes) out %llu (%llu bytes)\n",
+	       c.frames_in, c.bytes_in, c.frames_out, c.bytes_out);
+	printf("  dropped oversize %llu no M-PDU %llu socket queue %llu "
+	       "invalid %llu\n", c.drop_oversize, c.drop_no_mpdu, c.drop_rxq,
+	       c.drop_invalid);
+	printf("  syscalls %llu (%.3f per frame)\n", c.syscalls,
+	       frames ? (double)c.syscalls / frames : 0.0);
+
+	if (c.ring_slots)
+		printf("  frame ring used %llu max %llu of %llu slots "
+		       "overflow %llu\n", c.ring_used, c.ring_max,
+		       c.ring_slots, c.ring_overflow);
+
+	if (c.tx_stalls)
+		printf("  TX stalls %llu (%.3f ms) pending queue %llu max %llu\n",
+		       c.tx_stalls, c.tx_stall_ns / 1e6, c.txq_len, c.txq_max);
+
+	printf("  M-PDUs sent by");
+	for (i = 0; i < METRICS_REASONS; i++)
+		printf(" %s %llu", metrics_reason(i), c.mpdus[i]);
+	printf("\n");
+
+	for (late = 0, i = 0; i < METRICS_LATE_BUCKETS; i++)
+		late += c.late[i];
+
+	if (late) {
+		printf("  M-PDU timeout lateness max %.3f ms\n   ",
+		       c.late_max_ns / 1e6);
+		for (i = 0; i < METRICS_LATE_BUCKETS - 1; i++)
+			printf(" <%uus:%llu", 1U << i, c.late[i]);
+		printf(" >=%uus:%llu\n", 1U << (i - 1), c.late[i]);
+	}
+
+	printf("  M-PDU fill ratio");
+	for (i = 0; i < METRICS_FILL_BUCKETS; i++)
+		printf(" %d%%:%llu", i * 100 / METRICS_FILL_BUCKETS, c.fill[i]);
+	printf("\n");
+
+	printf("  C-PDUs per M-PDU");
+	for (i = 0; i < METRICS_CPDU_BUCKETS; i++)
+		printf(" %d:%llu", 1 << i, c.cpdus[i]);
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	unsigned long interval_ms = 0;
+	struct mpdu_metrics *m;
+	char path[64];
+	int fd;
+
+	while ((opt = getopt(argc, argv, "i:h?")) != -1) {
+		switch (opt) {
+
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
+	}
+
+	if (argc - optind != 1) {
+		print_usage(basename(argv[0]));
+		exit(0);
+	}
+
+	snprintf(path, sizeof(path), "/%s", argv[optind]);
+
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("shm_open");
+		return 1;
+	}
+
+	m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (m->magic != METRICS_MAGIC || m->version != METRICS_VERSION) {
+		fprintf(stderr, "no valid counters in '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	while (1) {
+		print_metrics(m);
+
+		if (!interval_ms)
+			break;
+
+		usleep(interval_ms * 1000);
+	}
+
+	munmap(m, sizeof(*m));
+
+	return 0;
+}
@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * packetring.h - memory-mapped AF_PACKET TPACKET_V3 rings on CAN interfaces
+ *
+ * The kernel fills the RX ring with blocks of received frames and hands
+ * over a block when it is full or after PRING_BLOCK_TOV_MS. The frames
+ * are parsed in place and the block is handed back afterwards, so one
+ * wakeup covers a whole block. TX frames are composed in place in the
+ * slots of the TX ring and one send() hands over all filled slots.
+ *
+ * The RX socket is bound to ETH_P_ALL to see the outgoing frames of the
+ * other local sockets too (vcan). A classic BPF filter only passes CAN
+ * frames (and optionally CAN XL frames with matching CAN_RAW filters).
+ * The TX socket receives nothing and sends with ETH_P_CANXL. Frames from
+ * the TX ring are not looped back to local CAN_RAW sockets.
+ */
+
+#ifndef PACKETRING_H
+#define PACKETRING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <linux/types.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/can.h>
+
+#define PRING_BLOCK_SIZE (1 << 16)
+#define PRING_RX_BLOCKS 64
+#define PRING_TX_BLOCKS 16
+#define PRING_BLOCK_TOV_MS 1 /* hand over partially filled RX blocks */
+
+/* TX frame layout without PACKET_TX_HAS_OFF */
+#define PRING_TX_DATA TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define PRING_FRAME_SIZE TPACKET_ALIGN(PRING_TX_DATA + \
+				       sizeof(struct canxl_frame))
+#define PRING_FRAMES_PER_BLOCK (PRING_BLOCK_SIZE / PRING_FRAME_SIZE)
+
+struct pring {
+	int s;
+	__u8 *map;
+	size_t maplen;
+	struct sockaddr_ll addr; /* destination of the TX ring */
+
+	/* RX ring */
+	unsigned int rx_blocks;
+	unsigned int rx_block; /* next block to process */
+	struct tpacket_block_desc *bd; /* block in process (NULL = none) */
+	struct tpacket3_hdr *pkt; /* next frame in the block */
+	unsigned int pkt_left;
+	int losing; /* the kernel has dropped frames */
+
+	/* TX ring */
+	__u8 *tx;
+	unsigned int tx_frames;
+	unsigned int tx_head; /* next slot to fill */
+	unsigned int pending; /* filled slots not handed over yet */
+};
+
+static inline int pring_open(struct pring *r, unsigned int rx_blocks,
+			     unsigned int tx_blocks)
+{
+	struct tpacket_req3 req;
+	int ver = TPACKET_V3;
+
+	memset(r, 0, sizeof(*r));
+	r->rx_blocks = rx_blocks;
+	r->tx_frames = tx_blocks * PRING_FRAMES_PER_BLOCK;
+
+	/* no protocol => no reception before the filter is attached */
+	r->s = socket(AF_PACKET, SOCK_RAW, 0);
+	if (r->s < 0) {
+		perror("packet socket");
+		return -1;
+	}
+
+	if (setsockopt(r->s, SOL_PACKET, PACKET_VERSION, &ver,
+		       sizeof(ver)) < 0) {
+		perror("sockopt PACKET_VERSION");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PRING_BLOCK_SIZE;
+	req.tp_frame_size = PRING_FRAME_SIZE;
+
+	if (rx_blocks) {
+		req.tp_block_nr = rx_blocks;
+		req.tp_frame_nr = rx_blocks * PRING_FRAMES_PER_BLOCK;
+		req.tp_retire_blk_tov = PRING_BLOCK_TOV_MS;
+		if (setsockopt(r->s, SOL_PACKET, PACKET_RX_RING, &req,
+			       sizeof(req)) < 0) {
+			perror("sockopt PACKET_RX_RING");
+			return -1;
+		}
+	}
+
+	if (tx_blocks) {
+		/* no block timeout for the (frame based) TX ring */
+		req.tp_block_nr = tx_blocks;
+		req.tp_frame_nr = r->tx_frames;
+		req.tp_retire_blk_tov = 0;
+		if (setsockopt(r->s, SOL_PACKET, PACKET_TX_RING, &req,
+			       sizeof(req)) < 0) {
+			perror("sockopt PACKET_TX_RING");
+			return -1;
+		}
+	}
+
+	/* the RX ring is followed by the TX ring */
+	r->maplen = (size_t)(rx_blocks + tx_blocks) * PRING_BLOCK_SIZE;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->s, 0);
+	if (r->map == MAP_FAILED) {
+		/* RLIMIT_MEMLOCK */
+		r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, r->s, 0);
+	}
+	if (r->map == MAP_FAILED) {
+		perror("packet ring mmap");
+		return -1;
+	}
+	r->tx = r->map + (size_t)rx_blocks * PRING_BLOCK_SIZE;
+
+	return 0;
+}
+
+static inline void pring_close(struct pring *r)
+{
+	munmap(r->map, r->maplen);
+	close(r->s);
+}
+
+/*
+ * Only pass CAN frames (e.g. for the 'any' interface). xl = only CAN XL
+ * frames whose first word (prio) matches one of the n CAN_RAW filters
+ * (n = 0: all CAN XL frames).
+ */
+static inline int pring_filter(struct pring *r, int xl,
+			       struct can_filter *f, unsigned int n)
+{
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	unsigned int len, i, pc = 0;
+	int ret;
+
+	if (!xl)
+		n = 0;
+
+	/* hatype check, protocol check, filters, drop, accept */
+	len = 2 + (xl ? 2 : 0) + (n ? 3 * n : 1) + 2;
+	code = calloc(len, sizeof(*code));
+	if (!code) {
+		perror("calloc");
+		return -1;
+	}
+
+#define PRING_DROP (len - 2 - pc - 1)
+#define PRING_ACCEPT (len - 1 - pc - 1)
+
+	code[pc] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+						SKF_AD_OFF + SKF_AD_HATYPE);
+	pc++;
+	code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						ARPHRD_CAN, 0, PRING_DROP);
+	pc++;
+
+	if (xl) {
+		code[pc] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+							SKF_AD_OFF +
+							SKF_AD_PROTOCOL);
+		pc++;
+		code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ |
+							BPF_K, ETH_P_CANXL, 0,
+							PRING_DROP);
+		pc++;
+	}
+
+	/* BPF loads in network byte order - the frame is in host order */
+	for (i = 0; i < n; i++) {
+		code[pc] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+							0);
+		pc++;
+		code[pc] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K,
+							htonl(f[i].can_mask));
+		pc++;
+		code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+							htonl(f[i].can_id &
+							      f[i].can_mask),
+							PRING_ACCEPT, 0);
+		pc++;
+	}
+
+	if (!n) {
+		code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JA,
+							PRING_ACCEPT, 0, 0);
+		pc++;
+	}
+
+	code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+
+#undef PRING_DROP
+#undef PRING_ACCEPT
+
+	prog.len = len;
+	prog.filter = code;
+	ret = setsockopt(r->s, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			 sizeof(prog));
+	if (ret < 0)
+		perror("sockopt SO_ATTACH_FILTER");
+
+	free(code);
+
+	return ret;
+}
+
+/* start the reception (RX ring) and set the TX destination (0 = any) */
+static inline int pring_bind(struct pring *r, int ifindex)
+{
+	struct sockaddr_ll ll;
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_ifindex = ifindex;
+	ll.sll_protocol = r->rx_blocks ? htons(ETH_P_ALL) : 0;
+
+	if (bind(r->s, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+		perror("packet bind");
+		return -1;
+	}
+
+	r->addr = ll;
+	r->addr.sll_protocol = htons(ETH_P_CANXL);
+
+	return 0;
+}
+
+static inline struct tpacket_block_desc *pring_block(struct pring *r,
+						     unsigned int i)
+{
+	return (struct tpacket_block_desc *)(r->map +
+					     (size_t)i * PRING_BLOCK_SIZE);
+}
+
+/*
+ * Next received frame (NULL = no frame available). The frame stays valid
+ * until the next call that hands back its block to the kernel.
+ */
+static inline struct tpacket3_hdr *pring_rx_next(struct pring *r)
+{
+	struct tpacket3_hdr *pkt;
+	__u32 status;
+
+	if (r->bd && !r->pkt_left) {
+		__atomic_store_n(&r->bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		r->bd = NULL;
+		r->rx_block = (r->rx_block + 1) % r->rx_blocks;
+	}
+
+	if (!r->bd) {
+		r->bd = pring_block(r, r->rx_block);
+		status = __atomic_load_n(&r->bd->hdr.bh1.block_status,
+					 __ATOMIC_ACQUIRE);
+		if (!(status & TP_STATUS_USER)) {
+			r->bd = NULL;
+			return NULL;
+		}
+
+		if (status & TP_STATUS_LOSING)
+			r->losing = 1;
+
+		r->pkt = (struct tpacket3_hdr *)((__u8 *)r->bd +
+						 r->bd->hdr.bh1.offset_to_first_pkt);
+		r->pkt_left = r->bd->hdr.bh1.num_pkts;
+		if (!r->pkt_left)
+			return pring_rx_next(r);
+	}
+
+	pkt = r->pkt;
+	r->pkt = (struct tpacket3_hdr *)((__u8 *)pkt + pkt->tp_next_offset);
+	r->pkt_left--;
+
+	return pkt;
+}
+
+/* frames left in the current block */
+static inline unsigned int pring_rx_left(struct pring *r)
+{
+	return r->pkt_left;
+}
+
+/* wait for the next block (-1 = error, e.g. EINTR) */
+static inline int pring_rx_wait(struct pring *r)
+{
+	struct pollfd pfd = { .fd = r->s, .events = POLLIN };
+
+	return poll(&pfd, 1, -1);
+}
+
+static inline void *pring_data(struct tpacket3_hdr *pkt)
+{
+	return (__u8 *)pkt + pkt->tp_mac;
+}
+
+/* interface and protocol of the received frame */
+static inline struct sockaddr_ll *pring_addr(struct tpacket3_hdr *pkt)
+{
+	return (struct sockaddr_ll *)((__u8 *)pkt +
+				      TPACKET_ALIGN(sizeof(*pkt)));
+}
+
+/* software RX timestamp (CLOCK_REALTIME in ns) */
+static inline __u64 pring_tstamp(struct tpacket3_hdr *pkt)
+{
+	return pkt->tp_sec * 1000000000ULL + pkt->tp_nsec;
+}
+
+/* frames dropped by the kernel (full RX ring) since the last call */
+static inline __u32 pring_drops(struct pring *r)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (!r->losing)
+		return 0;
+
+	r->losing = 0;
+
+	/* reading the statistics resets them */
+	if (getsockopt(r->s, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+		return 0;
+
+	return st.tp_drops;
+}
+
+static inline struct tpacket3_hdr *pring_tx_hdr(struct pring *r,
+						unsigned int i)
+{
+	i %= r->tx_frames;
+
+	return (struct tpacket3_hdr *)(r->tx +
+				       (size_t)(i / PRING_FRAMES_PER_BLOCK) *
+				       PRING_BLOCK_SIZE +
+				       (i % PRING_FRAMES_PER_BLOCK) *
+				       PRING_FRAME_SIZE);
+}
+
+/* free TX slot to compose a frame in place (NULL = ring full) */
+static inline struct canxl_frame *pring_tx_get(struct pring *r)
+{
+	struct tpacket3_hdr *hdr = pring_tx_hdr(r, r->tx_head);
+
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+	    TP_STATUS_AVAILABLE)
+		return NULL;
+
+	return (struct canxl_frame *)((__u8 *)hdr + PRING_TX_DATA);
+}
+
+/* the frame in the slot from pring_tx_get() is complete */
+static inline void pring_tx_put(struct pring *r, unsigned int len)
+{
+	struct tpacket3_hdr *hdr = pring_tx_hdr(r, r->tx_head++);
+
+	hdr->tp_len = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+			 __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+/*
+ * Hand over the filled TX slots without waiting for their transmission:
+ * 1 = handed over, 0 = nothing to do, -1 = error (errno). The slots stay
+ * filled after ENOBUFS (full CAN TX queue) and are handed over again.
+ */
+static inline int pring_tx_flush(struct pring *r)
+{
+	if (!r->pending)
+		return 0;
+
+	if (sendto(r->s, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&r->addr,
+		   sizeof(r->addr)) < 0)
+		return -1;
+
+	r->pending = 0;
+
+	return 1;
+}
+
+#endif /* PACKETRING_H */
@@ -1,3 +1,6 @@
+#ifndef PRINTFRAME_H
+#define PRINTFRAME_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -66,3 +69,5 @@ static inline void printccframe(struct can_frame *cf)
 	printf("\n");
 	fflush(stdout);
 }
+
+#endif /* PRINTFRAME_H */
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * rtmode.h - real-time mode for deterministic M-PDU timeouts
+ *
+ * The process (and the threads it starts afterwards) runs with SCHED_FIFO,
+ * optionally pinned to one CPU. All current and future memory is locked,
+ * which also faults in the buffers allocated so far, and the stack is
+ * prefaulted. The timer slack of 50 us that delays the timer expiries of
+ * normal tasks is reduced to 1 ns.
+ */
+
+#ifndef RTMODE_H
+#define RTMODE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#define RT_STACK_PREFAULT (512 * 1024)
+
+/* <prio>[:<cpu>] (cpu = -1: no pinning) */
+static inline int rt_parse(const char *arg, int *prio, int *cpu)
+{
+	char *end;
+
+	*prio = strtol(arg, &end, 10);
+	*cpu = -1;
+	if (end != arg && *end == ':')
+		*cpu = strtol(end + 1, &end, 10);
+
+	if (end == arg || *end ||
+	    *prio < sched_get_priority_min(SCHED_FIFO) ||
+	    *prio > sched_get_priority_max(SCHED_FIFO) ||
+	    *cpu < -1 || *cpu >= CPU_SETSIZE)
+		return -1;
+
+	return 0;
+}
+
+/* touch the stack pages that are used later (locked by mlockall()) */
+static __attribute__((noinline)) void rt_prefault_stack(void)
+{
+	unsigned char buf[RT_STACK_PREFAULT];
+
+	memset(buf, 0, sizeof(buf));
+	__asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+/* call after allocating the buffers - before starting threads */
+static inline int rt_enable(int prio, int cpu)
+{
+	struct sched_param sp = { .sched_priority = prio };
+	cpu_set_t set;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			return -1;
+		}
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		return -1;
+	}
+
+	rt_prefault_stack();
+
+	if (prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) < 0) {
+		perror("prctl PR_SET_TIMERSLACK");
+		return -1;
+	}
+
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+		perror("sched_setscheduler SCHED_FIFO");
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif /* RTMODE_H */
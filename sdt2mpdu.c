@@ -10,11 +10,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <net/if.h>
 #include <arpa/inet.h> /* for network byte order conversion */
 
@@ -23,85 +28,1938 @@
 #include <linux/can/raw.h>
 #include "cia-611-2.h"
 #include "printframe.h"
+#include "dwelltime.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "transport.h"
+#include "txqueue.h"
+#include "uring.h"
+#include "packetring.h"
+#include "rtmode.h"
+#include "timerwheel.h"
+#include "mpducore.h"
+
+#define MAX_RX_BATCH 256 /* max. number of CAN XL frames per recvmmsg() */
+#define MAX_SRC_IF 16 /* max. number of source CAN interfaces */
+#define CTRL_EVENT (MAX_SRC_IF + 1) /* epoll event data for the ctrl socket */
+#define SIGNAL_EVENT (MAX_SRC_IF + 2) /* epoll event data for the signalfd */
+#define DST_EVENT (MAX_SRC_IF + 3) /* epoll event data for the dst socket */
+#define MAX_EVENTS (MAX_SRC_IF + 4)
+#define MAX_TRANSFER_IDS 64 /* max. number of -t options */
+#define DEFAULT_STREAMS 64 /* default number of concurrently open M-PDUs */
+#define MAX_STREAMS 65536
+#define MAX_RULES 64 /* max. number of -B latency budget rules */
+#define CTRLMSG_SIZE (CMSG_SPACE(sizeof(struct timeval)) + \
+		      CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+		      CMSG_SPACE(sizeof(__u32)))
+#define MAX_BINS 16 /* max. number of open M-PDUs per stream for packing */
+#define EWMA_SHIFT 3 /* EWMA weight 1/8 for the adaptive send trigger */
+#define MAX_GAP_NS 10000000000ULL /* limit idle times for the EWMA */
+#define CTRL_PATH_MAX sizeof(((struct sockaddr_un *)0)->sun_path)
+#define MAX_SIGNALS 8 /* signals per signalfd read */
+#define BUSY_POLL_SPINS 64 /* busy-poll: check the other fds every n spins */
+#define URING_RX_BUFS 256 /* provided buffers per source (power of 2) */
+
+/* io_uring request types */
+enum {
+	URING_RECV,
+	URING_SEND,
+	URING_TIMER,
+	URING_TIMER_UPDATE,
+	URING_SIGNAL,
+	URING_CTRL,
+};
 
 extern int optind, opterr, optopt;
 
+/* source CAN interface */
+struct src_if {
+	char *name;
+	int s; /* socket */
+	__u8 vcid; /* source identity that is put into the C-PDU c_info */
+	__u32 key; /* stream of the last received C-PDU */
+	__u64 rxstamp; /* RX timestamp of the current C-PDU */
+	__u32 drops; /* kernel drop counter of the socket (SO_RXQ_OVFL) */
+	struct capture cap; /* capture file input (offline mode) */
+	struct uring_bufs bufs; /* provided buffers (io_uring) */
+	int rearm; /* multishot receive has terminated (io_uring) */
+	struct pring ring; /* memory-mapped AF_PACKET RX ring */
+
+	/* adaptive send trigger: C-PDU statistics of this interface */
+	__u64 last_rx; /* arrival time of the last C-PDU */
+	__s64 gap_ewma; /* inter-arrival time in ns */
+	__s64 size_ewma; /* C-PDU size in the M-PDU incl. C-PDU header */
+};
+
+static struct src_if srcs[MAX_SRC_IF];
+static unsigned int nsrcs;
+
+/* latency budget for C-PDUs with a specific SDT and AF (= c_id) range */
+struct budget_rule {
+	__u8 sdt;
+	__u32 af_from;
+	__u32 af_to;
+	__u64 budget_ns;
+};
+
+static struct budget_rule rules[MAX_RULES];
+static unsigned int nrules;
+
+/*
+ * Open M-PDU of a stream that is identified by the VCID of the source
+ * interface and the transfer ID (= prio) of the received C-PDUs.
+ */
+struct mpdu_stream {
+	struct mpdu_stream *hnext; /* hash bucket chain */
+	struct mpdu_stream *next; /* free list */
+	struct tw_timer timer; /* M-PDU timeout */
+	__u32 key;
+	__u64 deadline; /* M-PDU timeout (CLOCK_MONOTONIC in ns) */
+	__u64 start; /* arrival time of the first C-PDU */
+	unsigned int target_size; /* adaptive send trigger M-PDU size */
+	__u64 *rxstamps; /* RX timestamps of the C-PDUs (dwell time) */
+	struct mpdu_builder mb;
+	struct canxl_frame cf;
+};
+
+#define STREAM_KEY(vcid, prio) (((__u32)(vcid) << 16) | (prio))
+
+/* M-PDU composer */
+static int dst; /* socket */
+static __u64 timer_deadline; /* next timer event (0 = none) */
+static unsigned int nstreams = DEFAULT_STREAMS;
+static struct mpdu_stream *pool; /* preallocated M-PDU buffers */
+static struct mpdu_stream *freelist;
+static struct mpdu_stream **hashtab;
+static unsigned int hashmask;
+static struct timer_wheel wheel; /* deadlines of the open M-PDUs */
+static unsigned int mpdu_max_size = MPDU_DEFAULT_SIZE;
+static unsigned long timeout_ms = MPDU_DEFAULT_TIMEOUT_MS;
+static unsigned int max_cpdus; /* send M-PDU after max_cpdus C-PDUs */
+static __u64 latency_ns; /* adaptive send trigger latency target */
+static FILE *recfile; /* M-PDU send trigger decisions */
+static unsigned int bins; /* open M-PDUs per stream for bin packing */
+static int best_fit; /* bin packing strategy (first-fit/best-fit) */
+static int per_vcid; /* separate M-PDUs for each source interface */
+static int zerocopy;
+static struct mpdu_metrics local_metrics;
+static struct mpdu_metrics *metrics = &local_metrics;
+static struct trace_ring *trace; /* asynchronous verbose output */
+static char *srcnames[MAX_SRC_IF];
+static int measure; /* measure C-PDU dwell times */
+static struct dwell_stats dwell;
+static int verbose;
+static int running = 1;
+static int busy_poll; /* spin instead of waiting for events */
+static struct dwell_hist wake; /* wake-to-process latency (with -D) */
+static int rcvbuf; /* socket buffer sizes (0 = system default) */
+static int sndbuf;
+
+/* pending M-PDUs while the destination does not take frames */
+static struct tx_dst tx;
+static unsigned int txq_size = TXQ_DEFAULT_SIZE;
+static int dst_polled; /* waiting for EPOLLOUT on dst */
+static int srcs_paused; /* no reception while the queue is full */
+
+/* io_uring I/O engine */
+static int use_uring;
+static struct uring ur;
+static struct msghdr uring_msg; /* layout of the provided buffers */
+static struct __kernel_timespec uring_ts; /* M-PDU timer expiry */
+static int timer_armed; /* IORING_OP_TIMEOUT pending */
+static int timer_expired;
+static int signal_pending;
+static int ctrl_pending;
+static unsigned int poll_rearm; /* multishot polls to re-arm */
+
+/* memory-mapped AF_PACKET rings */
+static int use_packet;
+static struct pring dring; /* TX ring of the dst_if */
+static int ring_blocked; /* handing over the TX ring failed (ENOBUFS) */
+
+/* capture file input and output */
+static int offline; /* recorded timestamps are the time base */
+static __u64 offline_now;
+static FILE *outfile;
+
+/* batched reception with recvmmsg() */
+static unsigned int batch = 1;
+static struct canxl_frame *cfsrcs;
+static struct mmsghdr *msgs;
+static struct iovec *iovs;
+static char (*ctrlmsgs)[CTRLMSG_SIZE];
+
 void print_usage(char *prg)
 {
-	fprintf(stderr, "%s - CAN XL CiA 611-2 MPDU composer\n\n", prg);
-	fprintf(stderr, "Usage: %s [options] <src_if> <dst_if>\n", prg);
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "         -t <transfer_id> (TRANSFER ID "
-		"- default: 0x%03X)\n", DEFAULT_TRANSFER_ID);
-	fprintf(stderr, "         -l <size>        (limit PDU size"
-		" to %ld .. %d, default: %d)\n", MPDU_MIN_SIZE, MPDU_MAX_SIZE,
-		MPDU_DEFAULT_SIZE);
-	fprintf(stderr, "         -T <timeout_ms>  (M-PDU transmission timeout "
-		"- default: %d msecs)\n", MPDU_DEFAULT_TIMEOUT_MS);
-	fprintf(stderr, "         -v               (verbose)\n");
+	fprintf(stderr, "%s - CAN XL CiA 611-2 MPDU composer\n\n", prg);
+	fprintf(stderr, "Usage: %s [options] <src_if>[:<vcid>] "
+		"[<src_if>[:<vcid>] ...] <dst_if>\n", prg);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "         -t <transfer_id> (TRANSFER ID "
+		"- default: 0x%03X - up to %d times)\n", DEFAULT_TRANSFER_ID,
+		MAX_TRANSFER_IDS);
+	fprintf(stderr, "         -l <size>        (limit PDU size"
+		" to %ld .. %d, default: %d)\n", MPDU_MIN_SIZE, MPDU_MAX_SIZE,
+		MPDU_DEFAULT_SIZE);
+	fprintf(stderr, "         -T <timeout_ms>  (M-PDU transmission timeout "
+		"- default: %d msecs)\n", MPDU_DEFAULT_TIMEOUT_MS);
+	fprintf(stderr, "         -n <count>       (send M-PDU after <count> "
+		"C-PDUs - default: off)\n");
+	fprintf(stderr, "         -c <path>        (on demand M-PDU sending "
+		"via unix datagram socket)\n");
+	fprintf(stderr, "         -A <latency_ms>  (adaptive M-PDU timeout and "
+		"size for latency target)\n");
+	fprintf(stderr, "         -r <file>        (record M-PDU send "
+		"trigger decisions)\n");
+	fprintf(stderr, "         -e               (separate M-PDUs for each "
+		"source interface)\n");
+	fprintf(stderr, "         -p <first|best>:<bins> (pack C-PDUs into "
+		"up to %d open M-PDUs -\n"
+		"                          reorders the C-PDUs, also of the "
+		"same CAN ID)\n", MAX_BINS);
+	fprintf(stderr, "         -B <sdt>:<af_from>:<af_to>:<budget_ms>\n"
+		"                          (latency budget rule for C-PDUs - "
+		"up to %d times)\n", MAX_RULES);
+	fprintf(stderr, "         -S <streams>     (max. concurrently open M-PDUs "
+		"1 .. %d - default: %d)\n", MAX_STREAMS, DEFAULT_STREAMS);
+	fprintf(stderr, "         -b <frames>      (receive up to <frames> C-PDUs "
+		"per syscall 1 .. %d - default: 1)\n", MAX_RX_BATCH);
+	fprintf(stderr, "         -z               (zero-copy reception of C-PDUs "
+		"into the M-PDU)\n");
+	fprintf(stderr, "         -Q <frames>      (pending M-PDUs while dst is "
+		"blocked 1 .. %d - default: %d)\n", TXQ_MAX_SIZE,
+		TXQ_DEFAULT_SIZE);
+	fprintf(stderr, "         -s <rcv>[:<snd>] (socket receive and send "
+		"buffer size in bytes)\n");
+	fprintf(stderr, "         -U               (io_uring I/O engine instead "
+		"of epoll)\n");
+	fprintf(stderr, "         -k               (memory-mapped AF_PACKET "
+		"RX/TX rings on the CAN\n"
+		"                          interfaces)\n");
+	fprintf(stderr, "         -y               (busy-poll the sources "
+		"instead of waiting - with -D:\n"
+		"                          wake-to-process latency)\n");
+	fprintf(stderr, "         -P <prio>[:cpu]  (real-time mode: SCHED_FIFO "
+		"<prio>, pinned to <cpu>,\n"
+		"                          locked memory, 1 ns timer slack)\n");
+	fprintf(stderr, "         -M <name>        (export counters to shared "
+		"memory /dev/shm/<name>)\n");
+	fprintf(stderr, "         -D               (measure C-PDU dwell "
+		"times - dump with SIGUSR2)\n");
+	fprintf(stderr, "         -v               (verbose)\n");
+	fprintf(stderr, "         -V <n>           (asynchronous verbose "
+		"output for every <n>th frame\n"
+		"                          and every <n>th sent M-PDU)\n");
+	fprintf(stderr, "         -i               (<src_if> are capture files "
+		"- offline conversion)\n");
+	fprintf(stderr, "         -o               (<dst_if> is a capture "
+		"file)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Up to %d source interfaces can be composed into one "
+		"M-PDU stream.\n", MAX_SRC_IF);
+	fprintf(stderr, "The source identity <vcid> (hex) is put into the "
+		"C-PDU c_info element\n");
+	fprintf(stderr, "(default: 0x%02X + position of <src_if> in the "
+		"list).\n", DEFAULT_VCID);
+	fprintf(stderr, "The C-PDUs of all sources with the same transfer ID "
+		"share one M-PDU\n(with -e: each VCID and transfer ID "
+		"combination has its own M-PDU).\n");
+	fprintf(stderr, "An M-PDU is sent at the earliest deadline of its "
+		"C-PDUs. The deadline of\na C-PDU is defined by the first "
+		"matching -B rule (hex values) or by\nthe M-PDU timeout.\n");
+	fprintf(stderr, "All open M-PDUs are sent on demand when receiving "
+		"SIGUSR1 or any datagram\non the control socket <path>.\n");
+	fprintf(stderr, "Instead of CAN interfaces fd:<n> (inherited socket) "
+		"and unix:<path> AF_UNIX\nSOCK_SEQPACKET transports can "
+		"be used (no CAN filters).\n");
+	fprintf(stderr, "Capture files are converted at memory speed with "
+		"the M-PDU timeouts based\non the recorded timestamps.\n");
+	fprintf(stderr, "While <dst_if> is blocked (EAGAIN/ENOBUFS) the M-PDUs "
+		"are queued and the open\nM-PDUs keep aggregating C-PDUs "
+		"beyond their timeout. A full queue pauses\nthe reception.\n");
+	fprintf(stderr, "The M-PDUs sent with -k are not looped back to local "
+		"CAN_RAW sockets.\n");
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	if (offline)
+		return offline_now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* hand over the TX ring: 1 = done, 0 = transient failure (errno) */
+static int packet_kick(void)
+{
+	int ret = pring_tx_flush(&dring);
+
+	if (ret)
+		metrics->syscalls++;
+
+	if (ret >= 0) {
+		ring_blocked = 0;
+		return 1;
+	}
+
+	if (!tx_transient(errno)) {
+		perror("packet ring send");
+		exit(1);
+	}
+
+	ring_blocked = 1;
+	return 0;
+}
+
+/* copy the M-PDU into a TX ring slot: 1 = done, 0 = ring full (errno) */
+static int packet_tx(struct canxl_frame *cfx)
+{
+	struct canxl_frame *slot = pring_tx_get(&dring);
+
+	/* the kernel releases the slots of the sent frames */
+	if (!slot) {
+		if (!packet_kick())
+			return 0;
+
+		slot = pring_tx_get(&dring);
+		if (!slot) {
+			errno = EAGAIN; /* wait for EPOLLOUT */
+			return 0;
+		}
+	}
+
+	memcpy(slot, cfx, CANXL_HDR_SIZE + cfx->len);
+	pring_tx_put(&dring, CANXL_HDR_SIZE + cfx->len);
+
+	return 1;
+}
+
+/* send without blocking: 1 = sent, 0 = transient failure (errno), -1 = error */
+static int dst_frame(struct canxl_frame *cfx)
+{
+	if (use_packet)
+		return packet_tx(cfx);
+
+	metrics->syscalls++;
+	return tx_frame(dst, cfx);
+}
+
+/* M-PDUs are waiting for the destination */
+static int tx_pending(void)
+{
+	return txq_len(&tx.q) || ring_blocked;
+}
+
+/* send the pending M-PDUs (wait = block until the queue has drained) */
+static void tx_flush(int wait)
+{
+	int ret;
+
+	while (txq_len(&tx.q)) {
+		ret = dst_frame(txq_front(&tx.q));
+		if (ret < 0) {
+			perror("write dst canxl_frame");
+			exit(1);
+		}
+
+		if (!ret) {
+			tx_dst_blocked(&tx, errno);
+			if (!wait)
+				return;
+			tx_wait(dst, tx.q.err);
+			continue;
+		}
+
+		txq_pop(&tx.q);
+		metrics->txq_len = txq_len(&tx.q);
+	}
+
+	/* one syscall for all M-PDUs in the TX ring */
+	while (use_packet && !packet_kick()) {
+		tx_dst_blocked(&tx, errno);
+		if (!wait)
+			return;
+		tx_wait(dst, tx.q.err);
+	}
+
+	tx_stall_end(&tx.stall_start, now_ns, metrics);
+}
+
+static void uring_tx_wait(void);
+
+/* retry to send the pending M-PDUs after ENOBUFS */
+static void tx_resume(void)
+{
+	if (use_uring) {
+		/* the next chain of linked sends starts with the queue head */
+		ur.tx_blocked = 0;
+		tx.q.err = 0;
+	} else
+		tx_flush(0);
+}
+
+void write_mpdu(int s, struct canxl_frame *cfx, unsigned int *dataptr)
+{
+	int ret;
+
+	cfx->len = *dataptr;
+
+	/* paranoia check */
+	if (!cfx->len) {
+		printf("%s: failure: dataptr is zero!\n", __FUNCTION__);
+		exit(1);
+	}
+
+	/* clear M-PDU frame */
+	*dataptr = 0;
+
+	if (outfile) {
+		if (capture_write(outfile, offline ? offline_now : dwell_now(),
+				  cfx) < 0)
+			exit(1);
+		return;
+	}
+
+	/* write M-PDU frame to destination socket - if not blocked */
+	if (!use_uring && !txq_len(&tx.q)) {
+		ret = dst_frame(cfx);
+		if (ret > 0)
+			return;
+
+		if (ret < 0) {
+			perror("write dst canxl_frame");
+			exit(1);
+		}
+
+		tx_dst_blocked(&tx, errno);
+	}
+
+	/* the reception is paused before - unless a burst fills the queue */
+	while (txq_full(&tx.q)) {
+		if (use_uring) {
+			uring_tx_wait();
+			continue;
+		}
+		tx_wait(s, tx.q.err);
+		tx_flush(0);
+	}
+
+	tx_dst_queue(&tx, cfx);
+
+	/* no event loop to wait for the destination */
+	if (offline)
+		tx_flush(1);
+}
+
+/* (re)arm, move or remove the IORING_OP_TIMEOUT (0 = no deadline) */
+static int uring_timer(__u64 deadline)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur);
+
+	if (!sqe)
+		return -1; /* next loop */
+
+	uring_ts.tv_sec = deadline / 1000000000ULL;
+	uring_ts.tv_nsec = deadline % 1000000000ULL;
+
+	if (!deadline) {
+		uring_prep_timeout_update(sqe, URING_UD(URING_TIMER, 0), NULL,
+					  0, URING_UD(URING_TIMER_UPDATE, 0));
+		timer_armed = 0;
+	} else if (timer_armed) {
+		uring_prep_timeout_update(sqe, URING_UD(URING_TIMER, 0),
+					  &uring_ts, IORING_TIMEOUT_ABS,
+					  URING_UD(URING_TIMER_UPDATE, 0));
+	} else {
+		uring_prep_timeout(sqe, &uring_ts, IORING_TIMEOUT_ABS,
+				   URING_UD(URING_TIMER, 0));
+		timer_armed = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the next event of the timer wheel. The epoll loop waits up to this
+ * time (no syscall), the io_uring engine (re)arms its timeout - if changed.
+ */
+static void update_timer(void)
+{
+	__u64 deadline = 0;
+
+	/* no M-PDU timeouts while blocked - only the ENOBUFS retry */
+	if (tx_pending()) {
+		if (tx.q.err == ENOBUFS)
+			deadline = tx.retry;
+	} else if (!tw_empty(&wheel))
+		deadline = tw_next(&wheel);
+
+	if (deadline == timer_deadline)
+		return;
+
+	if (use_uring) {
+		if (!uring_timer(deadline))
+			timer_deadline = deadline;
+		return;
+	}
+
+	timer_deadline = deadline;
+}
+
+/* the source interfaces share the M-PDUs of a transfer ID by default */
+static __u32 stream_key(__u8 vcid, canid_t prio)
+{
+	return STREAM_KEY(per_vcid ? vcid : 0, prio);
+}
+
+static unsigned int stream_hash(__u32 key)
+{
+	return ((key ^ (key >> 11)) * 0x9E3779B1U) & hashmask;
+}
+
+static struct mpdu_stream *stream_lookup(__u32 key)
+{
+	struct mpdu_stream *st;
+
+	for (st = hashtab[stream_hash(key)]; st; st = st->hnext)
+		if (st->key == key)
+			return st;
+
+	return NULL;
+}
+
+/* dwell times from C-PDU reception to the M-PDU transmission */
+static void dwell_account(struct mpdu_stream *st, unsigned int len)
+{
+	struct mpdu_iter it;
+	struct cpdu c;
+	__u64 now = offline ? offline_now : dwell_now();
+	unsigned int i = 0;
+
+	if (mpdu_iter_init(&it, st->cf.data, len) < 0)
+		return;
+
+	while (mpdu_iter_next(&it, &c) > 0) {
+		if (st->rxstamps[i])
+			dwell_add(&dwell, c.c_type, now - st->rxstamps[i]);
+		i++;
+	}
+}
+
+/* send out the stream's M-PDU and put its buffer back into the pool */
+static void stream_flush(struct mpdu_stream *st, int reason)
+{
+	struct mpdu_stream **pst;
+
+	if (verbose)
+		printf("(%s) sending M-PDU vcid %02X tid %03X with length %u "
+		       "(fill %u%%)\n", metrics_reason(reason), st->key >> 16,
+		       st->cf.prio, st->mb.len,
+		       st->mb.len * 100 / mpdu_max_size);
+
+	/* decision of the (adaptive) send trigger and its outcome */
+	if (recfile)
+		fprintf(recfile, "%llu %02X %03X %u %llu %s %u %u %llu %.3f\n",
+			st->start, st->key >> 16, st->cf.prio,
+			st->target_size, st->deadline - st->start,
+			metrics_reason(reason), st->mb.len, st->mb.ncpdus, now_ns() - st->start,
+			(double)st->mb.len / mpdu_max_size);
+
+	if (trace && trace_sample_mpdu(trace))
+		trace_mpdu(trace, reason, st->key >> 16, st->cf.prio,
+			   st->mb.len, st->mb.len * 100 / mpdu_max_size);
+
+	mpdu_finish(&st->mb, &st->cf, reason, mpdu_max_size, metrics);
+
+	write_mpdu(dst, &st->cf, &st->mb.len);
+
+	if (measure)
+		dwell_account(st, st->cf.len);
+
+	/* stop the M-PDU timeout */
+	tw_del(&wheel, &st->timer);
+
+	/* remove from hash table */
+	for (pst = &hashtab[stream_hash(st->key)]; *pst != st;
+	     pst = &(*pst)->hnext)
+		;
+	*pst = st->hnext;
+
+	st->next = freelist;
+	freelist = st;
+}
+
+/* open a new M-PDU for the stream */
+static struct mpdu_stream *stream_new(__u8 vcid, canid_t prio)
+{
+	__u32 key = stream_key(vcid, prio);
+	struct mpdu_stream *st;
+	unsigned int hash;
+
+	/* no free buffer => send out the M-PDU with the earliest deadline */
+	if (!freelist)
+		stream_flush(tw_entry(tw_first(&wheel), struct mpdu_stream,
+				      timer), METRICS_POOL);
+
+	st = freelist;
+	freelist = st->next;
+
+	st->key = key;
+	mpdu_start(&st->mb, &st->cf, prio, mpdu_max_size);
+
+	hash = stream_hash(key);
+	st->hnext = hashtab[hash];
+	hashtab[hash] = st;
+
+	return st;
+}
+
+static struct mpdu_stream *stream_get(__u8 vcid, canid_t prio)
+{
+	struct mpdu_stream *st;
+
+	st = stream_lookup(stream_key(vcid, prio));
+	if (st)
+		return st;
+
+	return stream_new(vcid, prio);
+}
+
+/*
+ * Bin packing: Select the open M-PDU of the stream where the C-PDU with
+ * the given size fits in. First-fit takes the oldest M-PDU, best-fit the
+ * M-PDU with the least remaining space. When no M-PDU has enough space
+ * a new M-PDU is opened. If the stream already has the maximum number of
+ * open M-PDUs the fullest one is sent out before.
+ * The M-PDUs of a stream are not sent in the order of their C-PDUs, so
+ * the reception order is lost - also for the C-PDUs with the same CAN ID.
+ */
+static struct mpdu_stream *stream_pack(__u8 vcid, canid_t prio,
+				       unsigned int size)
+{
+	__u32 key = stream_key(vcid, prio);
+	struct mpdu_stream *st, *fit = NULL, *fullest = NULL;
+	unsigned int nbins = 0;
+
+	for (st = hashtab[stream_hash(key)]; st; st = st->hnext) {
+		if (st->key != key)
+			continue;
+
+		nbins++;
+
+		if (!fullest || st->mb.len > fullest->mb.len)
+			fullest = st;
+
+		if (size > mpdu_max_size - st->mb.len)
+			continue;
+
+		if (!fit ||
+		    (best_fit && st->mb.len > fit->mb.len) ||
+		    (!best_fit && st->start < fit->start))
+			fit = st;
+	}
+
+	if (fit)
+		return fit;
+
+	if (nbins >= bins)
+		stream_flush(fullest, METRICS_BUFFER);
+
+	return stream_new(vcid, prio);
+}
+
+/* send out all open M-PDUs */
+static void flush_all(int reason)
+{
+	struct tw_timer *t;
+
+	while ((t = tw_first(&wheel)))
+		stream_flush(tw_entry(t, struct mpdu_stream, timer), reason);
+}
+
+/* update the C-PDU arrival statistics of the source interface */
+static void adaptive_update(struct src_if *src, __u64 now, unsigned int padsz)
+{
+	__s64 gap = MAX_GAP_NS;
+	__s64 size = C_PDU_HEADER_SIZE + padsz;
+
+	/* initialize the statistics with the first C-PDU */
+	if (!src->last_rx) {
+		src->last_rx = now;
+		src->gap_ewma = gap;
+		src->size_ewma = size;
+		return;
+	}
+
+	if (now - src->last_rx < MAX_GAP_NS)
+		gap = now - src->last_rx;
+	src->last_rx = now;
+
+	src->gap_ewma += (gap - src->gap_ewma) >> EWMA_SHIFT;
+	src->size_ewma += (size - src->size_ewma) >> EWMA_SHIFT;
+}
+
+/*
+ * Adaptive send trigger: Calculate the M-PDU size that is expected to be
+ * reached within the latency target and send out the M-PDU when this
+ * size is reached or when the next C-PDU was expected (but did not come)
+ * after this fill time. The latency target is never exceeded.
+ */
+static void adaptive_start(struct src_if *src, struct mpdu_stream *st,
+			   __u64 now)
+{
+	__u64 gap = src->gap_ewma ? src->gap_ewma : 1;
+	__u64 cpdus = 1 + latency_ns / gap; /* expected C-PDUs in time */
+	__u64 size = cpdus * src->size_ewma;
+	__u64 wait;
+
+	if (size > mpdu_max_size) {
+		size = mpdu_max_size;
+		cpdus = size / src->size_ewma;
+	}
+	st->target_size = size;
+
+	/* time to reach the target size + one C-PDU gap */
+	wait = cpdus * gap;
+	if (wait > latency_ns)
+		wait = latency_ns;
+
+	st->deadline = now + wait;
+}
+
+/* get the C-PDU deadline from the first matching latency budget rule */
+static __u64 rule_deadline(struct canxl_hdr *hdr, __u64 now)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrules; i++)
+		if (rules[i].sdt == hdr->sdt &&
+		    rules[i].af_from <= hdr->af && hdr->af <= rules[i].af_to)
+			return now + rules[i].budget_ns;
+
+	return ULLONG_MAX; /* no rule - no deadline for this C-PDU */
+}
+
+/* get the M-PDU of the stream with enough space for the new C-PDU */
+static struct mpdu_stream *reserve_cpdu(struct src_if *src,
+					struct canxl_hdr *hdr,
+					unsigned int padsz)
+{
+	struct mpdu_stream *st;
+	__u64 now = now_ns();
+	__u64 deadline = ULLONG_MAX;
+
+	if (latency_ns)
+		adaptive_update(src, now, padsz);
+
+	if (bins) {
+		st = stream_pack(src->vcid, hdr->prio,
+				 C_PDU_HEADER_SIZE + padsz);
+	} else {
+		st = stream_get(src->vcid, hdr->prio);
+
+		/* does the new PDU still fit into available M-PDU space? */
+		if (!mpdu_fits(&st->mb, hdr->len)) {
+
+			/* no => send out the current M-PDU to make space */
+			stream_flush(st, METRICS_BUFFER);
+			st = stream_get(src->vcid, hdr->prio);
+		}
+	}
+
+	if (nrules)
+		deadline = rule_deadline(hdr, now);
+
+	if (st->mb.len == 0) {
+		/* start timeout when adding the first C-PDU element */
+		st->start = now;
+		if (latency_ns) {
+			adaptive_start(src, st, now);
+		} else {
+			st->deadline = now + timeout_ms * 1000000ULL;
+			st->target_size = mpdu_max_size;
+		}
+
+		if (deadline < st->deadline)
+			st->deadline = deadline;
+
+		tw_add(&wheel, &st->timer, st->deadline, now);
+
+	} else if (deadline < st->deadline) {
+		/* the new C-PDU has the earliest deadline => move M-PDU */
+		st->deadline = deadline;
+
+		tw_del(&wheel, &st->timer);
+		tw_add(&wheel, &st->timer, st->deadline, now);
+	}
+
+	return st;
+}
+
+/* append the C-PDU to the M-PDU (data may be already in place) */
+static void commit_cpdu(struct mpdu_stream *st, struct src_if *src,
+			struct canxl_hdr *hdr, __u8 *data, unsigned int padsz)
+{
+	struct cpdu c;
+	int ret;
+
+	cpdu_compose(&c, hdr, src->vcid, data);
+
+	if (measure)
+		st->rxstamps[st->mb.ncpdus] = src->rxstamp;
+
+	/* paranoia check - the space has been reserved before */
+	ret = mpdu_append(&st->mb, &c);
+	if (ret < 0) {
+		printf("%s: failure: %s!\n", __FUNCTION__, mpdu_strerror(ret));
+		exit(1);
+	}
+
+	if (verbose) {
+		printf("added C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
+		       c.c_type, c.c_info, c.c_dlen, c.c_id, padsz, st->mb.len);
+	}
+
+	if (trace && trace->sampled)
+		trace_cpdu(trace, TRACE_ADD_CPDU, c.c_type, c.c_info, c.c_dlen,
+			   c.c_id, padsz, st->mb.len);
+
+	/* limit the number of C-PDUs waiting in the M-PDU */
+	if (st->mb.ncpdus == max_cpdus)
+		stream_flush(st, METRICS_COUNT);
+	else if (latency_ns && st->mb.len >= st->target_size)
+		stream_flush(st, METRICS_TARGET);
+}
+
+static void add_cpdu(struct src_if *src, struct canxl_frame *cfsrc)
+{
+	struct mpdu_stream *st;
+	unsigned int padsz;
+
+	/* does the new PDU generally fit into the C-PDU space? */
+	if (cpdu_oversize(cfsrc->len, mpdu_max_size, metrics)) {
+		printf("dropped received PDU as it does not fit into M-PDU frame limit!");
+		return;
+	}
+
+	padsz = cpdu_padsz(cfsrc->len); /* real data length - not the DLC */
+
+	st = reserve_cpdu(src, (struct canxl_hdr *)cfsrc, padsz);
+	commit_cpdu(st, src, (struct canxl_hdr *)cfsrc, cfsrc->data, padsz);
+}
+
+/* wake-to-process latency of the received frame */
+static void wake_account(struct src_if *src)
+{
+	if (src->rxstamp)
+		dwell_hist_add(&wake, dwell_now() - src->rxstamp);
+}
+
+/* account the frames dropped by the kernel (msg = NULL: RX ring) */
+static void src_drops(struct src_if *src, struct msghdr *msg)
+{
+	__u32 delta = msg ? transport_drops(msg, &src->drops) :
+		pring_drops(&src->ring);
+
+	if (!delta)
+		return;
+
+	metrics->drop_rxq += delta;
+	fprintf(stderr, "%s: %u frames dropped (%s overflow)\n", src->name,
+		delta, msg ? "socket receive queue" : "RX ring");
+}
+
+/* the peer of a fd:/unix: transport has closed the connection */
+static void src_closed(struct src_if *src)
+{
+	if (verbose)
+		printf("source %s closed\n", src->name);
+
+	/* send out pending C-PDUs before termination */
+	flush_all(METRICS_EXIT);
+	running = 0;
+}
+
+/*
+ * Zero-copy reception: The CAN XL frame header is read into a scratch
+ * area and the payload is read directly behind the C-PDU header space
+ * of the M-PDU that is expected to take this C-PDU. This is the open
+ * M-PDU of the stream from the last C-PDU of this source interface or
+ * the next buffer of the pool. Payload that does not fit into the
+ * remaining M-PDU space spills into an overflow area. When the guess
+ * was wrong the C-PDU is assembled and added with add_cpdu().
+ */
+static void read_src_zc(struct src_if *src)
+{
+	static __u8 overflow[CANXL_MAX_DLEN];
+	struct canxl_hdr hdr;
+	struct canxl_frame *cfsrc = &cfsrcs[0];
+	struct mpdu_stream *st, *target;
+	struct iovec iov[3];
+	struct msghdr msg;
+	struct timeval tv;
+	__u8 *data = overflow;
+	unsigned int room = 0;
+	unsigned int padsz;
+	const char *err;
+	int nbytes;
+
+	target = stream_lookup(src->key);
+	if (target) {
+		room = mpdu_space(&target->mb);
+		if (room)
+			data = mpdu_cpdu_data(&target->mb);
+	} else if (freelist) {
+		data = &freelist->cf.data[C_PDU_HEADER_SIZE];
+		room = mpdu_max_size - C_PDU_HEADER_SIZE;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = CANXL_HDR_SIZE;
+	iov[1].iov_base = data;
+	iov[1].iov_len = room;
+	iov[2].iov_base = overflow;
+	iov[2].iov_len = sizeof(overflow);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	msg.msg_control = ctrlmsgs[0];
+	msg.msg_controllen = sizeof(ctrlmsgs[0]);
+
+	nbytes = recvmsg(src->s, &msg, busy_poll ? MSG_DONTWAIT : 0);
+	metrics->syscalls++;
+	if (nbytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
+		perror("recvmsg");
+		exit(1);
+	}
+
+	if (!nbytes) {
+		src_closed(src);
+		return;
+	}
+
+	err = frame_check(&hdr, nbytes);
+	if (err) {
+		fprintf(stderr, "read: %s\n", err);
+		exit(1);
+	}
+
+	metrics->frames_in++;
+	metrics->bytes_in += nbytes;
+	src_drops(src, &msg);
+
+	if (measure) {
+		src->rxstamp = dwell_rxstamp(&msg);
+		wake_account(src);
+	}
+
+	padsz = cpdu_padsz(hdr.len); /* real data length - not the DLC */
+
+	/* predict the stream for the next C-PDU from this source */
+	src->key = stream_key(src->vcid, hdr.prio);
+
+	st = stream_lookup(src->key);
+
+	/*
+	 * The data is in place when reserve_cpdu() returns the guessed
+	 * M-PDU. The verbose output needs the assembled CAN XL frame.
+	 */
+	if (!verbose && padsz <= room &&
+	    ((target && st == target) || (!target && !st))) {
+		if (trace && trace_sample(trace))
+			trace_frame(trace, src - srcs, &hdr, data, src->rxstamp);
+
+		st = reserve_cpdu(src, &hdr, padsz);
+		commit_cpdu(st, src, &hdr, data, padsz);
+		return;
+	}
+
+	/* assemble the CAN XL frame from the split payload */
+	memcpy(cfsrc, &hdr, CANXL_HDR_SIZE);
+	if (hdr.len <= room) {
+		memcpy(cfsrc->data, data, hdr.len);
+	} else {
+		memcpy(cfsrc->data, data, room);
+		memcpy(&cfsrc->data[room], overflow, hdr.len - room);
+	}
+
+	if (verbose) {
+		if (transport_stamp(src->s, src->name, &tv) < 0) {
+			perror("SIOCGSTAMP");
+			exit(1);
+		}
+
+		/* print timestamp and device name */
+		printf("(%ld.%06ld) %s ", tv.tv_sec, tv.tv_usec, src->name);
+
+		printxlframe(cfsrc);
+	}
+
+	if (trace && trace_sample(trace))
+		trace_frame(trace, src - srcs, (struct canxl_hdr *)cfsrc,
+			    cfsrc->data, src->rxstamp);
+
+	add_cpdu(src, cfsrc);
+}
+
+/*
+ * check and compose a received CAN XL frame (msg: control messages - NULL
+ * for the RX ring which provides src->rxstamp)
+ */
+static void rx_frame(struct src_if *src, struct canxl_frame *cfsrc,
+		     int nbytes, struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	const char *err;
+
+	err = frame_check((struct canxl_hdr *)cfsrc, nbytes);
+	if (err) {
+		fprintf(stderr, "read: %s\n", err);
+		exit(1);
+	}
+
+	metrics->frames_in++;
+	metrics->bytes_in += nbytes;
+	src_drops(src, msg);
+
+	if (measure && msg)
+		src->rxstamp = dwell_rxstamp(msg);
+
+	if (measure)
+		wake_account(src);
+
+	if (verbose) {
+		/* get timestamp from control message */
+		memset(&tv, 0, sizeof(tv));
+		if (!msg) {
+			tv.tv_sec = src->rxstamp / 1000000000ULL;
+			tv.tv_usec = (src->rxstamp % 1000000000ULL) / 1000;
+		}
+		for (cmsg = msg ? CMSG_FIRSTHDR(msg) : NULL; cmsg;
+		     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SO_TIMESTAMP)
+				memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+		}
+
+		/* print timestamp and device name */
+		printf("(%ld.%06ld) %s ", tv.tv_sec, tv.tv_usec, src->name);
+
+		printxlframe(cfsrc);
+	}
+
+	if (trace && trace_sample(trace))
+		trace_frame(trace, src - srcs, (struct canxl_hdr *)cfsrc,
+			    cfsrc->data, src->rxstamp);
+
+	add_cpdu(src, cfsrc);
+}
+
+static void read_src(struct src_if *src)
+{
+	int nframes, i;
+
+	/* timestamps and the kernel drop counter come with control messages */
+	for (i = 0; i < batch; i++) {
+		/* (re)init the message headers modified by recvmmsg() */
+		msgs[i].msg_hdr.msg_control = ctrlmsgs[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(ctrlmsgs[i]);
+		msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	/* read all available CAN XL frames up to batch size */
+	nframes = recvmmsg(src->s, msgs, batch, MSG_DONTWAIT, NULL);
+	metrics->syscalls++;
+	if (nframes < 0) {
+		/* spurious readiness or the socket is already drained */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
+		perror("recvmmsg");
+		exit(1);
+	}
+
+	if (!nframes) {
+		src_closed(src);
+		return;
+	}
+
+	if (verbose && batch > 1)
+		printf("(batch) received %d C-PDUs from %s\n",
+		       nframes, src->name);
+
+	for (i = 0; i < nframes; i++)
+		rx_frame(src, &cfsrcs[i], msgs[i].msg_len, &msgs[i].msg_hdr);
+}
+
+/* compose the CAN XL frames of one block of the RX ring in place */
+static void read_src_packet(struct src_if *src)
+{
+	struct tpacket3_hdr *pkt;
+
+	while ((pkt = pring_rx_next(&src->ring))) {
+		src->rxstamp = pring_tstamp(pkt);
+		rx_frame(src, pring_data(pkt), pkt->tp_snaplen, NULL);
+
+		/* the other sources get their turn after each block */
+		if (!pring_rx_left(&src->ring))
+			break;
+	}
+}
+
+/* flush the M-PDUs with a deadline up to the given recorded time */
+static void offline_timeouts(__u64 until)
+{
+	struct mpdu_stream *st;
+	struct tw_timer *t;
+
+	while ((t = tw_expire(&wheel, until))) {
+		st = tw_entry(t, struct mpdu_stream, timer);
+
+		/* the deadlines of one wheel tick are not sorted */
+		if (st->deadline > offline_now)
+			offline_now = st->deadline;
+
+		stream_flush(st, METRICS_TIMEOUT);
+	}
+}
+
+/*
+ * Offline conversion of capture files at memory speed: The CAN XL frames
+ * of all sources are processed in the order of their recorded timestamps
+ * which are also the time base for the M-PDU timeouts.
+ */
+static void convert_captures(struct can_filter *rfilter, unsigned int ntids)
+{
+	struct canxl_frame *cfsrc;
+	struct src_if *src;
+	__u64 tstamp, next;
+	unsigned int i;
+
+	while (1) {
+		/* source with the oldest frame */
+		src = NULL;
+		next = ULLONG_MAX;
+		for (i = 0; i < nsrcs; i++) {
+			tstamp = capture_tstamp(&srcs[i].cap);
+			if (tstamp < next) {
+				next = tstamp;
+				src = &srcs[i];
+			}
+		}
+
+		if (!src)
+			break;
+
+		offline_timeouts(next);
+		offline_now = next;
+
+		cfsrc = capture_next(&src->cap, &src->rxstamp);
+
+		/* filter only for transfer_ids (= prio_id) */
+		for (i = 0; i < ntids; i++)
+			if ((cfsrc->prio & rfilter[i].can_mask) ==
+			    (rfilter[i].can_id & rfilter[i].can_mask))
+				break;
+
+		if (i == ntids)
+			continue;
+
+		metrics->frames_in++;
+		metrics->bytes_in += CANXL_HDR_SIZE + cfsrc->len;
+
+		if (verbose) {
+			/* print timestamp and file name */
+			printf("(%llu.%06llu) %s ", src->rxstamp / 1000000000ULL,
+			       (src->rxstamp % 1000000000ULL) / 1000,
+			       src->name);
+
+			printxlframe(cfsrc);
+		}
+
+		if (trace && trace_sample(trace))
+			trace_frame(trace, src - srcs, (struct canxl_hdr *)cfsrc,
+				    cfsrc->data, src->rxstamp);
+
+		add_cpdu(src, cfsrc);
+	}
+
+	/* the remaining M-PDUs are sent at their deadlines */
+	offline_timeouts(ULLONG_MAX);
+}
+
+/*
+ * Wait for EPOLLOUT on the destination while M-PDUs are pending (ENOBUFS
+ * is retried with the timer) and pause the reception while the pending
+ * queue is full.
+ */
+static void tx_update(int efd)
+{
+	struct epoll_event event;
+	int poll_dst = txq_len(&tx.q) && tx.q.err != ENOBUFS;
+	int pause = txq_full(&tx.q);
+	unsigned int i;
+
+	if (poll_dst != dst_polled) {
+		event.events = EPOLLOUT;
+		event.data.u32 = DST_EVENT;
+		if (epoll_ctl(efd, poll_dst ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			      dst, &event)) {
+			perror("epoll_ctl dst");
+			exit(1);
+		}
+		metrics->syscalls++;
+		dst_polled = poll_dst;
+	}
+
+	/* busy-poll: the sources are not in the epoll set */
+	if (pause != srcs_paused && busy_poll)
+		srcs_paused = pause;
+
+	if (pause != srcs_paused) {
+		for (i = 0; i < nsrcs; i++) {
+			event.events = pause ? 0 : EPOLLIN;
+			event.data.u32 = i;
+			if (epoll_ctl(efd, EPOLL_CTL_MOD, srcs[i].s, &event)) {
+				perror("epoll_ctl src");
+				exit(1);
+			}
+			metrics->syscalls++;
+		}
+		srcs_paused = pause;
+	}
+}
+
+/* open the source sockets */
+static int open_srcs(struct can_filter *rfilter, unsigned int ntids)
+{
+	struct sockaddr_can addr;
+	struct src_if *src;
+	int ret, i;
+	int sockopt = 1;
+	int tsflags = DWELL_TSFLAGS;
+
+	for (i = 0; i < nsrcs; i++) {
+		src = &srcs[i];
+
+		if (!transport_is_can(src->name)) {
+			src->s = transport_open(src->name);
+			if (src->s < 0)
+				return -1;
+		} else if (use_packet) {
+			if (pring_open(&src->ring, PRING_RX_BLOCKS, 0) < 0 ||
+			    pring_filter(&src->ring, 1, rfilter, ntids) < 0 ||
+			    pring_bind(&src->ring,
+				       if_nametoindex(src->name)) < 0)
+				return -1;
+			src->s = src->ring.s;
+
+			if (busy_poll)
+				transport_busy_poll(src->s, src->name);
+
+			/* the ring provides timestamps and drops */
+			continue;
+		} else {
+			src->s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+			if (src->s < 0) {
+				perror("src socket");
+				return -1;
+			}
+			addr.can_family = AF_CAN;
+			addr.can_ifindex = if_nametoindex(src->name);
+
+			/* enable CAN XL frames */
+			ret = setsockopt(src->s, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
+					 &sockopt, sizeof(sockopt));
+			if (ret < 0) {
+				perror("src sockopt CAN_RAW_XL_FRAMES");
+				exit(1);
+			}
+
+			/* filter only for transfer_ids (= prio_id) */
+			ret = setsockopt(src->s, SOL_CAN_RAW, CAN_RAW_FILTER,
+					 rfilter, ntids * sizeof(rfilter[0]));
+			if (ret < 0) {
+				perror("src sockopt CAN_RAW_FILTER");
+				exit(1);
+			}
+
+			if (bind(src->s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				perror("bind");
+				return -1;
+			}
+		}
+
+		/* SIOCGSTAMP only provides the timestamp of the last frame in a batch */
+		if (verbose) {
+			ret = setsockopt(src->s, SOL_SOCKET, SO_TIMESTAMP,
+					 &sockopt, sizeof(sockopt));
+			if (ret < 0) {
+				perror("src sockopt SO_TIMESTAMP");
+				exit(1);
+			}
+		}
+
+		/* software RX timestamps to measure the C-PDU dwell time */
+		if (measure &&
+		    transport_timestamps(src->s, src->name, tsflags) < 0)
+			exit(1);
+
+		/* size the receive queue for bursts and detect its overflows */
+		if (rcvbuf && transport_bufsize(src->s, src->name, 1, rcvbuf) < 0)
+			return -1;
+
+		if (transport_drops_enable(src->s) < 0)
+			return -1;
+
+		if (busy_poll)
+			transport_busy_poll(src->s, src->name);
+	}
+
+	return 0;
+}
+
+/* on demand sending triggered by SIGUSR1 - and clean termination */
+static int open_signals(void)
+{
+	sigset_t sigmask;
+	int sfd;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGUSR2);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+		perror("sigprocmask");
+		return -1;
+	}
+
+	sfd = signalfd(-1, &sigmask, 0);
+	if (sfd < 0)
+		perror("signalfd");
+
+	return sfd;
+}
+
+/* on demand sending triggered by the control socket */
+static int open_ctrl(char *ctrl_path)
+{
+	struct sockaddr_un caddr;
+	int cfd;
+
+	cfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (cfd < 0) {
+		perror("ctrl socket");
+		return -1;
+	}
+
+	memset(&caddr, 0, sizeof(caddr));
+	caddr.sun_family = AF_UNIX;
+	strcpy(caddr.sun_path, ctrl_path);
+
+	/* remove stale socket from a former run */
+	unlink(ctrl_path);
+
+	if (bind(cfd, (struct sockaddr *)&caddr, sizeof(caddr)) < 0) {
+		perror("ctrl bind");
+		close(cfd);
+		return -1;
+	}
+
+	return cfd;
+}
+
+static void close_live(int sfd, int cfd, char *ctrl_path)
+{
+	int i;
+
+	for (i = 0; i < nsrcs; i++) {
+		if (use_packet)
+			pring_close(&srcs[i].ring);
+		else
+			close(srcs[i].s);
+	}
+
+	close(sfd);
+
+	if (cfd >= 0) {
+		close(cfd);
+		unlink(ctrl_path);
+	}
+}
+
+/* on demand sending includes the C-PDUs received before */
+static void handle_signo(int signo)
+{
+	switch (signo) {
+	case SIGUSR1:
+		flush_all(METRICS_DEMAND);
+		break;
+
+	case SIGUSR2:
+		dwell_dump(&dwell, "sdt2mpdu");
+		dwell_wake_dump(&wake, "sdt2mpdu", busy_poll);
+		break;
+
+	default:
+		/* send out pending C-PDUs before termination */
+		flush_all(METRICS_EXIT);
+		running = 0;
+		break;
+	}
+}
+
+static void handle_ctrl(int cfd)
+{
+	char ctrlmsg[64];
+	int ret;
+
+	/* one flush for all queued datagrams */
+	do {
+		ret = recv(cfd, ctrlmsg, sizeof(ctrlmsg), MSG_DONTWAIT);
+		metrics->syscalls++;
+	} while (ret >= 0);
+
+	if (errno != EAGAIN) {
+		perror("ctrl recv");
+		exit(1);
+	}
+
+	flush_all(METRICS_DEMAND);
+}
+
+static void handle_signal(int sfd)
+{
+	struct signalfd_siginfo siginfo[MAX_SIGNALS];
+	int n, i;
+
+	n = read(sfd, siginfo, sizeof(siginfo));
+	metrics->syscalls++;
+	if (n < 0) {
+		perror("signalfd read");
+		exit(1);
+	}
+
+	for (i = 0; i < n / (int)sizeof(siginfo[0]); i++)
+		handle_signo(siginfo[i].ssi_signo);
+}
+
+/* the M-PDU timer has expired */
+static void handle_timeouts(void)
+{
+	__u64 now = now_ns();
+	struct mpdu_stream *st;
+	struct tw_timer *t;
+
+	if (tx_pending() && now >= tx.retry)
+		tx_resume();
+
+	/* blocked => the open M-PDUs keep aggregating */
+	while (!tx_pending() && (t = tw_expire(&wheel, now))) {
+		st = tw_entry(t, struct mpdu_stream, timer);
+		metrics_late(metrics, now - st->deadline);
+		stream_flush(st, METRICS_TIMEOUT);
+	}
+}
+
+static void read_source(struct src_if *src)
+{
+	if (use_packet)
+		read_src_packet(src);
+	else if (zerocopy)
+		read_src_zc(src);
+	else
+		read_src(src);
+}
+
+/* wait for events up to the next timer event */
+static int wait_events(int efd, struct epoll_event *events)
+{
+	static int no_pwait2;
+	struct timespec ts = { 0, 0 };
+	__u64 now, wait = 0;
+	int ret;
+
+	if (!timer_deadline)
+		return epoll_wait(efd, events, MAX_EVENTS, -1);
+
+	now = now_ns();
+	if (timer_deadline > now)
+		wait = timer_deadline - now;
+
+	/* epoll_wait() has a timeout of milliseconds (rounded up) */
+	if (no_pwait2)
+		return epoll_wait(efd, events, MAX_EVENTS,
+				  (wait + 999999) / 1000000);
+
+	ts.tv_sec = wait / 1000000000ULL;
+	ts.tv_nsec = wait % 1000000000ULL;
+	ret = epoll_pwait2(efd, events, MAX_EVENTS, &ts, NULL);
+	if (ret < 0 && errno == ENOSYS) {
+		no_pwait2 = 1;
+		return wait_events(efd, events);
+	}
+
+	return ret;
+}
+
+/* event loop for the CAN interfaces */
+static int run_live(char *ctrl_path, struct can_filter *rfilter,
+		    unsigned int ntids)
+{
+	int efd; /* epoll fd */
+	int cfd = -1; /* control socket */
+	int sfd; /* signal fd */
+	struct epoll_event event, events[MAX_EVENTS];
+	unsigned int spins = 0;
+	int nevents, i;
+
+	efd = epoll_create1(0);
+	if (efd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	if (open_srcs(rfilter, ntids) < 0)
+		return 1;
+
+	/* busy-poll: the sources are spun directly */
+	for (i = 0; i < nsrcs && !busy_poll; i++) {
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, srcs[i].s, &event)) {
+			perror("epoll_ctl src");
+			return 1;
+		}
+	}
+
+	sfd = open_signals();
+	if (sfd < 0)
+		return 1;
+
+	event.events = EPOLLIN;
+	event.data.u32 = SIGNAL_EVENT;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event)) {
+		perror("epoll_ctl signalfd");
+		return 1;
+	}
+
+	if (ctrl_path) {
+		cfd = open_ctrl(ctrl_path);
+		if (cfd < 0)
+			return 1;
+
+		event.events = EPOLLIN;
+		event.data.u32 = CTRL_EVENT;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &event)) {
+			perror("epoll_ctl ctrl");
+			return 1;
+		}
+	}
+
+	/* receive buffers for (batched) CAN XL frame reception */
+	cfsrcs = calloc(batch, sizeof(*cfsrcs));
+	msgs = calloc(batch, sizeof(*msgs));
+	iovs = calloc(batch, sizeof(*iovs));
+	ctrlmsgs = calloc(batch, sizeof(*ctrlmsgs));
+	if (!cfsrcs || !msgs || !iovs || !ctrlmsgs) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < batch; i++) {
+		iovs[i].iov_base = &cfsrcs[i];
+		iovs[i].iov_len = sizeof(struct canxl_frame);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* main loop */
+	while (running) {
+
+		/*
+		 * Busy-poll: the non-blocking sources are read in every spin,
+		 * the signalfd, the ctrl socket and a blocked dst are only
+		 * checked every BUSY_POLL_SPINS spins.
+		 */
+		nevents = 0;
+		if (!busy_poll) {
+			nevents = wait_events(efd, events);
+			metrics->syscalls++;
+		} else if (++spins >= BUSY_POLL_SPINS) {
+			spins = 0;
+			nevents = epoll_wait(efd, events, MAX_EVENTS, 0);
+			metrics->syscalls++;
+		}
+
+		if (nevents < 0) {
+			perror("epoll_wait");
+			return 1;
+		}
+
+		/* handle the timeouts before adding new C-PDUs */
+		if (timer_deadline && now_ns() >= timer_deadline)
+			handle_timeouts();
+
+		for (i = 0; busy_poll && !srcs_paused && i < nsrcs && running; i++)
+			read_source(&srcs[i]);
+
+		for (i = 0; i < nevents; i++) {
+			if (events[i].data.u32 == DST_EVENT)
+				tx_flush(0);
+
+			if (events[i].data.u32 < nsrcs)
+				read_source(&srcs[events[i].data.u32]);
+		}
+
+		for (i = 0; i < nevents; i++) {
+			if (events[i].data.u32 == CTRL_EVENT)
+				handle_ctrl(cfd);
+			else if (events[i].data.u32 == SIGNAL_EVENT)
+				handle_signal(sfd);
+		}
+
+		/* hand over the M-PDUs of this loop with one syscall */
+		if (use_packet)
+			tx_flush(0);
+
+		tx_update(efd);
+		update_timer();
+
+	} /* while(running) */
+
+	/* send out the pending M-PDUs before termination */
+	tx_flush(1);
+
+	close_live(sfd, cfd, ctrl_path);
+
+	return 0;
+}
+
+/* received message that waits for being composed */
+struct uring_rx {
+	unsigned int src;
+	int bid; /* provided buffer (-1 = end of the connection) */
+};
+
+static struct uring_rx *uring_rxq; /* FIFO of all provided buffers */
+static unsigned int uring_rxq_size;
+static unsigned int uring_rxq_head, uring_rxq_tail;
+
+/* completion handling - the received messages are only queued here */
+static void uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_rx *rx;
+	struct src_if *src;
+	__u64 ud;
+	int ret;
+
+	while ((cqe = uring_peek(&ur))) {
+		ud = cqe->user_data;
+
+		switch (URING_UD_TYPE(ud)) {
+		case URING_RECV:
+			src = &srcs[URING_UD_IDX(ud)];
+
+			/* re-arm when the request terminates */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				src->rearm = 1;
+
+			/* all provided buffers in use => re-armed later */
+			if (cqe->res == -ENOBUFS)
+				break;
+
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror("io_uring recvmsg");
+				exit(1);
+			}
+
+			rx = &uring_rxq[uring_rxq_head++ % uring_rxq_size];
+			rx->src = URING_UD_IDX(ud);
+			rx->bid = -1;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				rx->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			break;
+
+		case URING_SEND:
+			ret = uring_send_done(&ur, &tx.q, cqe);
+			if (ret < 0) {
+				perror("write dst canxl_frame");
+				exit(1);
+			}
+
+			if (!ret && cqe->res != -ECANCELED)
+				tx_dst_blocked(&tx, -cqe->res);
+
+			metrics->txq_len = txq_len(&tx.q);
+			if (!txq_len(&tx.q))
+				tx_stall_end(&tx.stall_start, now_ns, metrics);
+			break;
+
+		case URING_TIMER:
+			/* -ETIME = expired, -ECANCELED = removed */
+			if (cqe->res == -ETIME) {
+				timer_deadline = 0;
+				timer_armed = 0;
+				timer_expired = 1;
+			}
+			break;
+
+		case URING_TIMER_UPDATE:
+			/* the timeout has expired before */
+			if (cqe->res == -ENOENT) {
+				timer_deadline = 0;
+				timer_armed = 0;
+			}
+			break;
+
+		case URING_SIGNAL:
+			signal_pending = 1;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				poll_rearm |= 1 << URING_SIGNAL;
+			break;
+
+		case URING_CTRL:
+			ctrl_pending = 1;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				poll_rearm |= 1 << URING_CTRL;
+			break;
+		}
+
+		uring_seen(&ur);
+	}
 }
 
-void write_mpdu(int s, struct canxl_frame *cfx, unsigned int *dataptr)
+/* submit and wait for at least one completion */
+static void uring_wait(void)
+{
+	int ret;
+
+	ret = uring_submit(&ur, 1);
+	metrics->syscalls++;
+	if (ret < 0 && errno != EINTR) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+
+	uring_reap();
+}
+
+/* send the pending M-PDUs and wait for the destination */
+static void uring_tx_wait(void)
+{
+	/* ENOBUFS: no event loop here for the retry timer */
+	if (ur.tx_blocked && !ur.tx_inflight) {
+		tx_wait(dst, ENOBUFS);
+		tx_resume();
+	}
+
+	uring_send_txq(&ur, &tx.q, dst, URING_UD(URING_SEND, 0));
+	uring_wait();
+}
+
+/* compose the received messages from the provided buffers */
+static void uring_rx(void)
 {
+	struct uring_rx *rx;
+	struct src_if *src;
+	struct msghdr msg;
+	void *payload;
 	int nbytes;
 
-	cfx->len = *dataptr;
+	while (running && uring_rxq_tail != uring_rxq_head) {
+		rx = &uring_rxq[uring_rxq_tail++ % uring_rxq_size];
+		src = &srcs[rx->src];
 
-	/* paranoia check */
-	if (!cfx->len) {
-		printf("%s: failure: dataptr is zero!\n", __FUNCTION__);
-		exit(1);
+		if (rx->bid < 0) {
+			src_closed(src);
+			return;
+		}
+
+		payload = uring_recvmsg(&src->bufs, rx->bid, &uring_msg, &msg,
+					&nbytes);
+
+		/* end of a fd:/unix: transport connection */
+		if (!nbytes) {
+			uring_bufs_put(&src->bufs, rx->bid);
+			src_closed(src);
+			return;
+		}
+
+		if (msg.msg_flags & MSG_TRUNC)
+			nbytes = 0; /* rejected by rx_frame() */
+
+		rx_frame(src, payload, nbytes, &msg);
+
+		uring_bufs_put(&src->bufs, rx->bid);
 	}
+}
 
-	/* write M-PDU frame to destination socket */
-	nbytes = write(s, cfx, CANXL_HDR_SIZE + cfx->len);
-	if (nbytes != CANXL_HDR_SIZE + cfx->len) {
-		printf("nbytes = %d\n", nbytes);
-		perror("write dst canxl_frame");
-		exit(1);
+static void uring_arm_recv(struct src_if *src)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur);
+
+	if (!sqe)
+		return; /* next loop */
+
+	uring_prep_recvmsg_multishot(sqe, src->s, &uring_msg, src - srcs,
+				     URING_UD(URING_RECV, src - srcs));
+	src->rearm = 0;
+}
+
+static void uring_arm_poll(int fd, unsigned int type)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur);
+
+	if (!sqe)
+		return; /* next loop */
+
+	uring_prep_poll_multishot(sqe, fd, POLLIN, URING_UD(type, 0));
+	poll_rearm &= ~(1 << type);
+}
+
+/* io_uring event loop for the CAN interfaces */
+static int run_uring(char *ctrl_path, struct can_filter *rfilter,
+		     unsigned int ntids)
+{
+	int cfd = -1; /* control socket */
+	int sfd; /* signal fd */
+	int i;
+
+	if (open_srcs(rfilter, ntids) < 0)
+		return 1;
+
+	sfd = open_signals();
+	if (sfd < 0)
+		return 1;
+
+	if (ctrl_path) {
+		cfd = open_ctrl(ctrl_path);
+		if (cfd < 0)
+			return 1;
 	}
 
-	/* clear M-PDU frame */
-	*dataptr = 0;
+	/* the whole pending queue can be sent with one chain */
+	if (uring_init(&ur, txq_size + nsrcs + 8) < 0)
+		return 1;
+
+	/* buffer layout: recvmsg header, control messages, CAN XL frame */
+	uring_msg.msg_controllen = CTRLMSG_SIZE;
+	uring_rxq_size = nsrcs * URING_RX_BUFS;
+	uring_rxq = calloc(uring_rxq_size, sizeof(*uring_rxq));
+	if (!uring_rxq) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < nsrcs; i++) {
+		if (uring_bufs_init(&ur, &srcs[i].bufs, i, URING_RX_BUFS,
+				    sizeof(struct io_uring_recvmsg_out) +
+				    CTRLMSG_SIZE + sizeof(struct canxl_frame)) < 0)
+			return 1;
+
+		uring_arm_recv(&srcs[i]);
+	}
+
+	uring_arm_poll(sfd, URING_SIGNAL);
+	if (cfd >= 0)
+		uring_arm_poll(cfd, URING_CTRL);
+
+	/* main loop */
+	while (running) {
+
+		uring_wait();
+
+		/* handle the timeouts before adding new C-PDUs */
+		if (timer_expired) {
+			timer_expired = 0;
+			handle_timeouts();
+		}
+
+		uring_rx();
+
+		if (ctrl_pending) {
+			ctrl_pending = 0;
+			handle_ctrl(cfd);
+		}
+
+		if (signal_pending) {
+			signal_pending = 0;
+			handle_signal(sfd);
+		}
+
+		/* the provided buffers have been handed back by uring_rx() */
+		for (i = 0; i < nsrcs; i++)
+			if (srcs[i].rearm)
+				uring_arm_recv(&srcs[i]);
+
+		if (poll_rearm & (1 << URING_SIGNAL))
+			uring_arm_poll(sfd, URING_SIGNAL);
+		if (poll_rearm & (1 << URING_CTRL))
+			uring_arm_poll(cfd, URING_CTRL);
+
+		update_timer();
+		uring_send_txq(&ur, &tx.q, dst, URING_UD(URING_SEND, 0));
+
+	} /* while(running) */
+
+	/* send out the pending M-PDUs before termination */
+	while (txq_len(&tx.q))
+		uring_tx_wait();
+
+	uring_exit(&ur);
+	close_live(sfd, cfd, ctrl_path);
+
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	int opt;
-	canid_t transfer_id = DEFAULT_TRANSFER_ID;
-	unsigned int mpdu_max_size = MPDU_DEFAULT_SIZE;
-	unsigned long timeout_ms = MPDU_DEFAULT_TIMEOUT_MS;
-	int verbose = 0;
-
-	int src, dst; /* sockets */
-	int tfd; /* timer fd */
-	fd_set rdfs;
+	canid_t transfer_id;
+	unsigned int ntids = 0;
+	double budget_ms;
+	unsigned int trace_sample_rate = 0;
+	char *ctrl_path = NULL;
+	struct src_if *src;
+	char *dst_if, *vcid;
+	int file_out = 0;
+	int rt_prio = 0, rt_cpu = -1; /* real-time mode (0 = off) */
 
 	struct sockaddr_can addr;
-	struct can_filter rfilter;
-	struct canxl_frame cfsrc, cfdst;
-	struct c_pdu_header *c_pdu_hdr;
-	unsigned int dataptr = 0;
-	unsigned int padsz;
+	struct can_filter rfilter[MAX_TRANSFER_IDS];
 
-	int nbytes, ret;
+	int ret, i;
 	int sockopt = 1;
-	struct timeval tv;
-
-	struct itimerspec spec = {
-		{ 0, 0 }, /* no interval timer */
-		{ 0, 0 }  /* no single timeout */
-	};
 
-	while ((opt = getopt(argc, argv, "t:l:T:vh?")) != -1) {
+	while ((opt = getopt(argc, argv, "t:l:T:n:c:A:r:eB:p:S:b:zQ:s:UkyP:M:DvV:ioh?")) != -1) {
 		switch (opt) {
 
 		case 't':
 			transfer_id = strtoul(optarg, NULL, 16);
-			if (transfer_id & ~CANXL_PRIO_MASK) {
+			if (transfer_id & ~CANXL_PRIO_MASK ||
+			    ntids >= MAX_TRANSFER_IDS) {
 				print_usage(basename(argv[0]));
 				return 1;
 			}
+			/* filter only for transfer_id (= prio_id) */
+			rfilter[ntids].can_id = transfer_id;
+			rfilter[ntids].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+				CAN_SFF_MASK;
+			ntids++;
 			break;
 
 		case 'l':
@@ -118,10 +1976,142 @@ int main(int argc, char **argv)
 			timeout_ms = strtoul(optarg, NULL, 10);
 			break;
 
+		case 'n':
+			max_cpdus = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			ctrl_path = optarg;
+			if (strlen(ctrl_path) >= CTRL_PATH_MAX) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'A':
+			latency_ns = strtod(optarg, NULL) * 1000000;
+			break;
+
+		case 'r':
+			recfile = fopen(optarg, "w");
+			if (!recfile) {
+				perror("record file");
+				return 1;
+			}
+			fprintf(recfile, "# start vcid tid target_size timeout "
+				"reason length cpdus latency fill\n");
+			break;
+
+		case 'B':
+			if (nrules >= MAX_RULES ||
+			    sscanf(optarg, "%hhx:%x:%x:%lf", &rules[nrules].sdt,
+				   &rules[nrules].af_from, &rules[nrules].af_to,
+				   &budget_ms) != 4) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			rules[nrules++].budget_ns = budget_ms * 1000000;
+			break;
+
+		case 'p':
+			if (!strncmp(optarg, "best:", 5))
+				best_fit = 1;
+			else if (strncmp(optarg, "first:", 6)) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			bins = strtoul(strchr(optarg, ':') + 1, NULL, 10);
+			if (bins < 1 || bins > MAX_BINS) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'e':
+			per_vcid = 1;
+			break;
+
+		case 'S':
+			nstreams = strtoul(optarg, NULL, 10);
+			if (nstreams < 1 || nstreams > MAX_STREAMS) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			if (batch < 1 || batch > MAX_RX_BATCH) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'z':
+			zerocopy = 1;
+			break;
+
+		case 'Q':
+			txq_size = strtoul(optarg, NULL, 10);
+			if (txq_size < 1 || txq_size > TXQ_MAX_SIZE) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 's':
+			if (sscanf(optarg, "%d:%d", &rcvbuf, &sndbuf) < 1 ||
+			    rcvbuf < 0 || sndbuf < 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'U':
+			use_uring = 1;
+			break;
+
+		case 'k':
+			use_packet = 1;
+			break;
+
+		case 'y':
+			busy_poll = 1;
+			break;
+
+		case 'P':
+			if (rt_parse(optarg, &rt_prio, &rt_cpu) < 0) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+
+		case 'M':
+			metrics = metrics_open(optarg, "sdt2mpdu");
+			if (!metrics)
+				return 1;
+			break;
+
+		case 'D':
+			measure = 1;
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
 
+		case 'V':
+			trace_sample_rate = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'i':
+			offline = 1;
+			break;
+
+		case 'o':
+			file_out = 1;
+			break;
+
 		case '?':
 		case 'h':
 		default:
@@ -131,219 +2121,217 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* src_if and dst_if are two mandatory parameters */
-	if (argc - optind != 2) {
+	/* at least one src_if and the dst_if are mandatory parameters */
+	if (argc - optind < 2 || argc - optind > MAX_SRC_IF + 1) {
 		print_usage(basename(argv[0]));
 		exit(0);
 	}
 
-	/* src_if */
-	if (strlen(argv[optind]) >= IFNAMSIZ) {
-		printf("Name of src CAN device '%s' is too long!\n\n",
-		       argv[optind]);
+	/* zero-copy reception writes into one known M-PDU per syscall */
+	if (zerocopy && (batch > 1 || bins)) {
+		fprintf(stderr, "Option -z can not be combined with -b or -p!\n\n");
+		print_usage(basename(argv[0]));
 		return 1;
 	}
 
-	/* dst_if */
-	if (strlen(argv[optind + 1]) >= IFNAMSIZ) {
-		printf("Name of dst CAN device '%s' is too long!\n\n",
-		       argv[optind]);
+	/* the io_uring completions and capture files are not spun */
+	if (busy_poll && (use_uring || offline)) {
+		fprintf(stderr, "Option -y can not be combined with -U or "
+			"-i!\n\n");
+		print_usage(basename(argv[0]));
 		return 1;
 	}
 
-	/* open src socket */
-	src = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (src < 0) {
-		perror("src socket");
+	/* io_uring receives each frame into its own provided buffer */
+	if (use_uring && (zerocopy || batch > 1 || offline || file_out)) {
+		fprintf(stderr, "Option -U can not be combined with -z, -b, -i "
+			"or -o!\n\n");
+		print_usage(basename(argv[0]));
 		return 1;
 	}
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = if_nametoindex(argv[optind]);
 
-	/* enable CAN XL frames */
-	ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
-			 &sockopt, sizeof(sockopt));
-	if (ret < 0) {
-		perror("src sockopt CAN_RAW_XL_FRAMES");
-		exit(1);
+	if (!ntids) {
+		rfilter[0].can_id = DEFAULT_TRANSFER_ID;
+		rfilter[0].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+		ntids = 1;
 	}
 
-	/* filter only for transfer_id (= prio_id) */
-	rfilter.can_id = transfer_id;
-	rfilter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
-	ret = setsockopt(src, SOL_CAN_RAW, CAN_RAW_FILTER,
-			 &rfilter, sizeof(rfilter));
-	if (ret < 0) {
-		perror("src sockopt CAN_RAW_FILTER");
-		exit(1);
-	}
+	/* src_if[:vcid] list */
+	for (i = optind; i < argc - 1; i++) {
+		src = &srcs[nsrcs];
+		src->name = argv[i];
+		src->vcid = DEFAULT_VCID + nsrcs;
 
-	if (bind(src, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+		vcid = strchr(argv[i] + transport_prefix(argv[i]), ':');
+		if (vcid) {
+			*vcid++ = 0;
+			src->vcid = strtoul(vcid, NULL, 16);
+		}
+		src->key = stream_key(src->vcid, rfilter[0].can_id);
+		srcnames[nsrcs] = src->name;
+
+		if (!offline && transport_is_can(src->name) &&
+		    strlen(src->name) >= IFNAMSIZ) {
+			printf("Name of src CAN device '%s' is too long!\n\n",
+			       src->name);
+			return 1;
+		}
+		nsrcs++;
 	}
 
-	/* open dst socket */
-	dst = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (dst < 0) {
-		perror("dst socket");
+	/* dst_if */
+	dst_if = argv[argc - 1];
+	if (!file_out && transport_is_can(dst_if) &&
+	    strlen(dst_if) >= IFNAMSIZ) {
+		printf("Name of dst CAN device '%s' is too long!\n\n",
+		       dst_if);
 		return 1;
 	}
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = if_nametoindex(argv[optind + 1]);
 
-	/* enable CAN XL frames */
-	ret = setsockopt(dst, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
-			 &sockopt, sizeof(sockopt));
-	if (ret < 0) {
-		perror("dst sockopt CAN_RAW_XL_FRAMES");
-		exit(1);
-	}
+	/* the AF_PACKET rings are bound to CAN interfaces */
+	if (use_packet) {
+		for (i = 0; i < nsrcs; i++)
+			if (!transport_is_can(srcs[i].name))
+				break;
 
-	if (bind(dst, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+		if (i < nsrcs || !transport_is_can(dst_if) || use_uring ||
+		    zerocopy || batch > 1 || offline || file_out) {
+			fprintf(stderr, "Option -k needs CAN interfaces and can "
+				"not be combined with -U, -z, -b, -i or -o!\n\n");
+			print_usage(basename(argv[0]));
+			return 1;
+		}
 	}
 
-	tfd = timerfd_create(CLOCK_MONOTONIC,  0);
-	if (tfd < 0) {
-		perror("timerfd create");
+	/* preallocate the M-PDU buffers to limit the memory consumption */
+	pool = calloc(nstreams, sizeof(*pool));
+	for (hashmask = 1; hashmask < 2 * nstreams; hashmask <<= 1)
+		;
+	hashtab = calloc(hashmask, sizeof(*hashtab));
+	hashmask--;
+	if (!pool || !hashtab) {
+		perror("calloc");
 		return 1;
 	}
 
-	/* set defaults for M-PDU CAN XL frame */
-	cfdst.prio = transfer_id;
-	cfdst.flags = CANXL_XLF; /* no SEC bit */
-	cfdst.sdt = MPDU_SDT;
-	cfdst.af = DEFAULT_AF;
-
-	/* main loop */
-	while (1) {
-
-		/* clear data for copying zero padded content */
-		memset(cfsrc.data, 0, sizeof(cfsrc.data));
-
-		FD_ZERO(&rdfs);
-		FD_SET(src, &rdfs);
-		FD_SET(tfd, &rdfs);
+	for (i = nstreams - 1; i >= 0; i--) {
+		pool[i].next = freelist;
+		freelist = &pool[i];
+	}
 
-		ret = select(((src > tfd)?src:tfd) + 1, &rdfs, NULL, NULL, NULL);
-		if (ret < 0) {
-			perror("select");
+	/* space for the RX timestamps of the max. number of C-PDUs */
+	if (measure) {
+		pool[0].rxstamps = calloc(nstreams * MPDU_MAX_C_PDUS,
+					  sizeof(__u64));
+		if (!pool[0].rxstamps) {
+			perror("calloc");
 			return 1;
 		}
 
-		if (FD_ISSET(tfd, &rdfs)) {
-			/* stop timer */
-			spec.it_value.tv_sec = 0;
-			spec.it_value.tv_nsec = 0;
-			timerfd_settime(tfd, 0, &spec, NULL);
-
-			if (verbose)
-				printf("(timeout) sending M-PDU with length %u\n", dataptr);
-
-			write_mpdu(dst, &cfdst, &dataptr);
-		}
+		for (i = 1; i < nstreams; i++)
+			pool[i].rxstamps = pool[0].rxstamps +
+				i * MPDU_MAX_C_PDUS;
+	}
 
-		if (!FD_ISSET(src, &rdfs))
-			continue;
+	tw_init(&wheel);
 
-		/* read CAN XL frame */
-		nbytes = read(src, &cfsrc, sizeof(struct canxl_frame));
-		if (nbytes < 0) {
-			perror("read");
+	if (trace_sample_rate) {
+		trace = trace_start(trace_sample_rate, srcnames,
+				    metrics_reason);
+		if (!trace) {
+			fprintf(stderr, "can not start trace thread\n");
 			return 1;
 		}
+	}
 
-		if (nbytes < CANXL_HDR_SIZE + CANXL_MIN_DLEN) {
-			fprintf(stderr, "read: no CAN frame\n");
+	/* open dst socket, transport or capture file */
+	if (file_out) {
+		outfile = capture_create(dst_if);
+		if (!outfile)
 			return 1;
-		}
-
-		if (!(cfsrc.flags & CANXL_XLF)) {
-			fprintf(stderr, "read: no CAN XL frame flag\n");
+	} else if (!transport_is_can(dst_if)) {
+		dst = transport_open(dst_if);
+		if (dst < 0)
 			return 1;
-		}
-
-		if (nbytes != CANXL_HDR_SIZE + cfsrc.len) {
-			printf("nbytes = %d\n", nbytes);
-			fprintf(stderr, "read: no CAN XL frame len\n");
+	} else if (use_packet) {
+		if (pring_open(&dring, 0, PRING_TX_BLOCKS) < 0 ||
+		    pring_bind(&dring, if_nametoindex(dst_if)) < 0)
+			return 1;
+		dst = dring.s;
+	} else {
+		dst = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (dst < 0) {
+			perror("dst socket");
 			return 1;
 		}
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = if_nametoindex(dst_if);
 
-		if (verbose) {
-			if (ioctl(src, SIOCGSTAMP, &tv) < 0) {
-				perror("SIOCGSTAMP");
-				return 1;
-			}
-
-			/* print timestamp and device name */
-			printf("(%ld.%06ld) %s ", tv.tv_sec, tv.tv_usec,
-			       argv[optind]);
-
-			printxlframe(&cfsrc);
-		}
-
-		padsz = cfsrc.len; /* real data length - not the DLC */
-
-		/* need to round up to next 4 byte boundary? */
-		if (padsz % 4)
-			padsz += (4 - padsz % 4);
-
-		/* does the new PDU generally fit into the C-PDU space? */
-		if (C_PDU_HEADER_SIZE + padsz > mpdu_max_size) {
-			printf("dropped received PDU as it does not fit into M-PDU frame limit!");
-			continue;
+		/* enable CAN XL frames */
+		ret = setsockopt(dst, SOL_CAN_RAW, CAN_RAW_XL_FRAMES,
+				 &sockopt, sizeof(sockopt));
+		if (ret < 0) {
+			perror("dst sockopt CAN_RAW_XL_FRAMES");
+			exit(1);
 		}
 
-		/* does the new PDU still fit into currently available M-PDU space? */
-		if (C_PDU_HEADER_SIZE + padsz > mpdu_max_size - dataptr) {
-
-			/* no => send out the current M-PDU to make space */
-
-			if (verbose)
-				printf("(buffer) sending M-PDU with length %u\n", dataptr);
-
-			/* stop timer */
-			spec.it_value.tv_sec = 0;
-			spec.it_value.tv_nsec = 0;
-			timerfd_settime(tfd, 0, &spec, NULL);
-
-			write_mpdu(dst, &cfdst, &dataptr);
+		if (bind(dst, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			return 1;
 		}
+	}
 
-		if (dataptr == 0) {
-			/* start timer when adding the first C-PDU element */
-			spec.it_value.tv_sec = timeout_ms / 1000;
-			spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
-			timerfd_settime(tfd, 0, &spec, NULL);
-		}
+	if (!outfile && !use_packet && sndbuf &&
+	    transport_bufsize(dst, dst_if, 0, sndbuf) < 0)
+		return 1;
 
-		/* fill C-PDU header */
-		c_pdu_hdr = (struct c_pdu_header *) &cfdst.data[dataptr];
+	if (!outfile && txq_create(&tx.q, txq_size) < 0) {
+		perror("calloc");
+		return 1;
+	}
+	tx.s = dst;
+	tx.clock = now_ns;
+	tx.metrics = metrics;
 
-		c_pdu_hdr->c_type = cfsrc.sdt;
-		c_pdu_hdr->c_info = DEFAULT_VCID;
-		c_pdu_hdr->c_dlen = htons(cfsrc.len);
-		c_pdu_hdr->c_id = htonl(cfsrc.af);
+	/* all buffers are allocated - lock them and go real-time */
+	if (rt_prio && rt_enable(rt_prio, rt_cpu) < 0)
+		return 1;
 
-		dataptr += C_PDU_HEADER_SIZE;
+	if (offline) {
+		for (i = 0; i < nsrcs; i++)
+			if (capture_open(&srcs[i].cap, srcs[i].name) < 0)
+				return 1;
 
-		/* copy data - cfsrc.data is zero padded */
-		memcpy(&cfdst.data[dataptr], cfsrc.data, padsz);
+		convert_captures(rfilter, ntids);
 
-		dataptr += padsz;
+		for (i = 0; i < nsrcs; i++)
+			capture_close(&srcs[i].cap);
+	} else if (use_uring) {
+		if (run_uring(ctrl_path, rfilter, ntids))
+			return 1;
+	} else if (run_live(ctrl_path, rfilter, ntids))
+		return 1;
 
-		if (verbose) {
-			printf("added C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
-			       c_pdu_hdr->c_type, c_pdu_hdr->c_info, c_pdu_hdr->c_dlen,
-			       c_pdu_hdr->c_id, padsz, dataptr);
+	if (outfile) {
+		if (fclose(outfile)) {
+			perror("capture close");
+			return 1;
 		}
+	} else if (use_packet)
+		pring_close(&dring);
+	else
+		close(dst);
 
-	} /* while(1) */
+	if (recfile)
+		fclose(recfile);
 
-	close(src);
-	close(dst);
+	if (trace)
+		trace_stop(trace);
+
+	if (measure) {
+		dwell_dump(&dwell, "sdt2mpdu");
+		dwell_wake_dump(&wake, "sdt2mpdu", busy_poll);
+	}
 
 	return 0;
 }
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * timerwheel.h - hierarchical timer wheel for the M-PDU deadlines
+ *
+ * The deadlines (ns) are rounded up to ticks of TW_TICK_NS. Level 0 has one
+ * slot per tick, each further level has slots of 64 times the length of
+ * the previous level. A timer is put into the level that covers its
+ * distance to the wheel clock, and is moved (cascaded) to the lower levels
+ * when the clock reaches the start of its slot. Adding, removing and
+ * expiring a timer is O(1). The per level bitmaps of the occupied slots
+ * give the next event of the wheel with a few bit operations, so it can be
+ * used as the timeout of the event loop instead of a timer syscall for
+ * each deadline.
+ *
+ * Deadlines beyond the range of the wheel (~19.5 hours) are kept in the
+ * last slot of the top level and are cascaded again.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <linux/types.h>
+
+#define TW_TICK_SHIFT 10 /* 1.024 us */
+#define TW_TICK_NS (1ULL << TW_TICK_SHIFT)
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1U << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 6
+#define TW_RANGE (1ULL << (TW_LEVELS * TW_SLOT_BITS)) /* ticks */
+#define TW_NONE ULLONG_MAX
+
+struct tw_timer {
+	struct tw_timer *prev, *next;
+	__u64 expires; /* tick */
+	unsigned int slot;
+};
+
+struct timer_wheel {
+	__u64 clk; /* current tick - the earlier ticks are done */
+	unsigned int count; /* pending timers */
+	__u64 pending[TW_LEVELS]; /* occupied slots */
+	struct tw_timer slot[TW_LEVELS * TW_SLOTS]; /* list heads */
+};
+
+/* get the structure that contains the timer */
+#define tw_entry(t, type, member) \
+	((type *)((char *)(t) - offsetof(type, member)))
+
+static inline void tw_init(struct timer_wheel *tw)
+{
+	unsigned int i;
+
+	tw->clk = 0;
+	tw->count = 0;
+	for (i = 0; i < TW_LEVELS; i++)
+		tw->pending[i] = 0;
+
+	for (i = 0; i < TW_LEVELS * TW_SLOTS; i++)
+		tw->slot[i].prev = tw->slot[i].next = &tw->slot[i];
+}
+
+static inline int tw_empty(struct timer_wheel *tw)
+{
+	return !tw->count;
+}
+
+/* first tick at or after the given time */
+static inline __u64 tw_tick(__u64 ns)
+{
+	return (ns >> TW_TICK_SHIFT) + !!(ns & (TW_TICK_NS - 1));
+}
+
+static inline __u64 tw_ror(__u64 bits, unsigned int n)
+{
+	n &= 63;
+	return n ? bits >> n | bits << (64 - n) : bits;
+}
+
+static inline void tw_link(struct timer_wheel *tw, struct tw_timer *t)
+{
+	__u64 delta = t->expires > tw->clk ? t->expires - tw->clk : 0;
+	__u64 expires = tw->clk + delta;
+	unsigned int level = 0;
+
+	if (delta >= TW_RANGE)
+		expires = tw->clk + TW_RANGE - 1;
+
+	while (delta >= (__u64)TW_SLOTS << (level * TW_SLOT_BITS) &&
+	       level < TW_LEVELS - 1)
+		level++;
+
+	t->slot = level * TW_SLOTS +
+		((expires >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK);
+	t->prev = tw->slot[t->slot].prev;
+	t->next = &tw->slot[t->slot];
+	t->prev->next = t;
+	t->next->prev = t;
+	tw->pending[level] |= 1ULL << (t->slot & TW_SLOT_MASK);
+}
+
+static inline void tw_unlink(struct timer_wheel *tw, struct tw_timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+
+	if (tw->slot[t->slot].next == &tw->slot[t->slot])
+		tw->pending[t->slot / TW_SLOTS] &=
+			~(1ULL << (t->slot & TW_SLOT_MASK));
+}
+
+/*
+ * Start the timer for the deadline (ns). The clock of an empty wheel is
+ * moved to the current time first to keep the timers in the lower levels.
+ */
+static inline void tw_add(struct timer_wheel *tw, struct tw_timer *t,
+			  __u64 deadline, __u64 now)
+{
+	if (!tw->count && (now >> TW_TICK_SHIFT) > tw->clk)
+		tw->clk = now >> TW_TICK_SHIFT;
+
+	t->expires = tw_tick(deadline);
+	tw_link(tw, t);
+	tw->count++;
+}
+
+static inline void tw_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	tw_unlink(tw, t);
+	tw->count--;
+}
+
+/*
+ * Next tick after the current one with expiring or cascading timers and
+ * its slot (TW_NONE = no timers after the current tick).
+ */
+static inline __u64 tw_next_tick(struct timer_wheel *tw, unsigned int *slot)
+{
+	__u64 next = TW_NONE, base, tick;
+	unsigned int level, shift;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (!tw->pending[level])
+			continue;
+
+		shift = level * TW_SLOT_BITS;
+		base = (tw->clk >> shift) + 1;
+		tick = base + __builtin_ctzll(tw_ror(tw->pending[level],
+						     base & TW_SLOT_MASK));
+		if (tick << shift < next) {
+			next = tick << shift;
+			*slot = level * TW_SLOTS + (tick & TW_SLOT_MASK);
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Time (ns) when tw_expire() has to be called next (TW_NONE = no timers).
+ * This can be a cascade before the earliest deadline.
+ */
+static inline __u64 tw_next(struct timer_wheel *tw)
+{
+	struct tw_timer *head = &tw->slot[tw->clk & TW_SLOT_MASK];
+	unsigned int slot;
+
+	if (!tw->count)
+		return TW_NONE;
+
+	/* timers of the current tick (added with a past deadline) */
+	if (head->next != head)
+		return tw->clk << TW_TICK_SHIFT;
+
+	return tw_next_tick(tw, &slot) << TW_TICK_SHIFT;
+}
+
+/* move the timers of the slot at the start of its time to lower levels */
+static inline void tw_cascade(struct timer_wheel *tw, unsigned int level)
+{
+	unsigned int idx = (tw->clk >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+	struct tw_timer *head = &tw->slot[level * TW_SLOTS + idx];
+	struct tw_timer *t;
+
+	while (head->next != head) {
+		t = head->next;
+		tw_unlink(tw, t);
+		tw_link(tw, t);
+	}
+}
+
+/*
+ * Return the next timer with a deadline up to the given time (ns) or NULL.
+ * The timer stays pending until it is removed with tw_del() or restarted.
+ * The timers of one tick are returned in the order they were added.
+ */
+static inline struct tw_timer *tw_expire(struct timer_wheel *tw, __u64 now)
+{
+	__u64 until = now >> TW_TICK_SHIFT;
+	struct tw_timer *head;
+	unsigned int level, slot;
+	__u64 next;
+
+	while (tw->count && tw->clk <= until) {
+		head = &tw->slot[tw->clk & TW_SLOT_MASK];
+		if (head->next != head)
+			return head->next;
+
+		next = tw_next_tick(tw, &slot);
+		if (next > until)
+			break;
+
+		tw->clk = next;
+		for (level = 1; level < TW_LEVELS; level++) {
+			if (next & ((1ULL << (level * TW_SLOT_BITS)) - 1))
+				break;
+			tw_cascade(tw, level);
+		}
+	}
+
+	/* nothing happens up to now */
+	if (until > tw->clk && until != (TW_NONE >> TW_TICK_SHIFT))
+		tw->clk = until;
+
+	return NULL;
+}
+
+/*
+ * Timer with the earliest deadline as far as the wheel resolution at its
+ * distance allows (the first timer of the next occupied slot) or NULL.
+ */
+static inline struct tw_timer *tw_first(struct timer_wheel *tw)
+{
+	struct tw_timer *head = &tw->slot[tw->clk & TW_SLOT_MASK];
+	unsigned int slot = 0;
+
+	if (!tw->count)
+		return NULL;
+
+	if (head->next != head)
+		return head->next;
+
+	tw_next_tick(tw, &slot);
+
+	return tw->slot[slot].next;
+}
+
+#endif /* TIMERWHEEL_H */
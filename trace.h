@@ -0,0 +1,300 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * trace.h - asynchronous binary trace with lock-free SPSC ring
+ *
+ * The event loop only writes fixed-size binary records into a single
+ * producer single consumer ring. A separate thread formats the records
+ * into the text output of the verbose mode (-v).
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <linux/types.h>
+#include <linux/can.h>
+
+#include "cia-611-2.h"
+#include "printframe.h"
+
+#define TRACE_RING_SIZE 4096 /* number of records (power of 2) */
+#define TRACE_DATA_SIZE 12 /* data bytes that are shown by printxlframe() */
+
+enum {
+	TRACE_RX_FRAME, /* received CAN XL frame */
+	TRACE_ADD_CPDU, /* C-PDU added to M-PDU */
+	TRACE_SEND_MPDU, /* composed M-PDU sent */
+	TRACE_SEND_CPDU, /* decomposed C-PDU sent */
+};
+
+struct trace_rec {
+	__u64 tstamp; /* CLOCK_REALTIME in ns */
+	__u8 type;
+	__u8 info; /* source index (RX) / c_info / send reason */
+	__u8 flags;
+	__u8 sdt; /* SDT / c_type */
+	__u16 len; /* CAN XL data length / c_dlen */
+	__u16 dataptr;
+	__u32 prio; /* prio / transfer id */
+	__u32 af; /* AF / c_id */
+	__u16 padsz;
+	__u8 fill; /* fill ratio in percent */
+	__u8 res;
+	__u8 data[TRACE_DATA_SIZE];
+};
+
+struct trace_ring {
+	struct trace_rec *rec;
+	unsigned int sample; /* record 1-in-N frames */
+	unsigned int cnt;
+	unsigned int mpdu_cnt; /* sent M-PDUs are sampled separately */
+	int sampled; /* the current frame is sampled */
+	__u64 dropped; /* records lost due to a full ring */
+	char **names; /* source interface names for TRACE_RX_FRAME */
+	const char *(*reason)(int); /* send reason names */
+	pthread_t thread;
+	int stop;
+
+	/* producer and consumer index on separate cache lines */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+};
+
+static inline __u64 trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* decide whether the records of the current frame are written */
+static inline int trace_sample(struct trace_ring *tr)
+{
+	tr->sampled = 0;
+
+	if (++tr->cnt >= tr->sample) {
+		tr->cnt = 0;
+		tr->sampled = 1;
+	}
+
+	return tr->sampled;
+}
+
+/* decide whether the sent M-PDU is recorded (1-in-N as the frames) */
+static inline int trace_sample_mpdu(struct trace_ring *tr)
+{
+	if (++tr->mpdu_cnt < tr->sample)
+		return 0;
+
+	tr->mpdu_cnt = 0;
+
+	return 1;
+}
+
+/* get the next free record (producer) - NULL when the ring is full */
+static inline struct trace_rec *trace_reserve(struct trace_ring *tr)
+{
+	unsigned int tail = __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE);
+
+	if (tr->head - tail >= TRACE_RING_SIZE) {
+		tr->dropped++;
+		return NULL;
+	}
+
+	return &tr->rec[tr->head & (TRACE_RING_SIZE - 1)];
+}
+
+/* make the record visible to the consumer */
+static inline void trace_commit(struct trace_ring *tr)
+{
+	__atomic_store_n(&tr->head, tr->head + 1, __ATOMIC_RELEASE);
+}
+
+/* the data must provide TRACE_DATA_SIZE bytes (or CAN XL frame length) */
+static inline void trace_frame(struct trace_ring *tr, __u8 src,
+			       struct canxl_hdr *hdr, __u8 *data, __u64 tstamp)
+{
+	struct trace_rec *r = trace_reserve(tr);
+
+	if (!r)
+		return;
+
+	r->tstamp = tstamp ? tstamp : trace_now();
+	r->type = TRACE_RX_FRAME;
+	r->info = src;
+	r->prio = hdr->prio;
+	r->flags = hdr->flags;
+	r->sdt = hdr->sdt;
+	r->af = hdr->af;
+	r->len = hdr->len;
+	memcpy(r->data, data, hdr->len < TRACE_DATA_SIZE ?
+	       hdr->len : TRACE_DATA_SIZE);
+	trace_commit(tr);
+}
+
+static inline void trace_cpdu(struct trace_ring *tr, __u8 type, __u8 c_type,
+			      __u8 c_info, __u16 c_dlen, __u32 c_id,
+			      unsigned int padsz, unsigned int dataptr)
+{
+	struct trace_rec *r = trace_reserve(tr);
+
+	if (!r)
+		return;
+
+	r->type = type;
+	r->sdt = c_type;
+	r->info = c_info;
+	r->len = c_dlen;
+	r->af = c_id;
+	r->padsz = padsz;
+	r->dataptr = dataptr;
+	trace_commit(tr);
+}
+
+static inline void trace_mpdu(struct trace_ring *tr, int reason, __u8 vcid,
+			      __u32 prio, unsigned int len, unsigned int fill)
+{
+	struct trace_rec *r = trace_reserve(tr);
+
+	if (!r)
+		return;
+
+	r->type = TRACE_SEND_MPDU;
+	r->info = reason;
+	r->sdt = vcid;
+	r->prio = prio;
+	r->dataptr = len;
+	r->fill = fill;
+	trace_commit(tr);
+}
+
+/* create the text output of the verbose mode */
+static inline void trace_format(struct trace_ring *tr, struct trace_rec *r,
+				struct canxl_frame *cfx)
+{
+	switch (r->type) {
+
+	case TRACE_RX_FRAME:
+		printf("(%llu.%06llu) %s ", r->tstamp / 1000000000ULL,
+		       (r->tstamp % 1000000000ULL) / 1000, tr->names[r->info]);
+
+		cfx->prio = r->prio;
+		cfx->flags = r->flags;
+		cfx->sdt = r->sdt;
+		cfx->af = r->af;
+		cfx->len = r->len;
+		memcpy(cfx->data, r->data, TRACE_DATA_SIZE);
+		printxlframe(cfx);
+		break;
+
+	case TRACE_ADD_CPDU:
+		printf("added C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
+		       r->sdt, r->info, r->len, r->af, r->padsz, r->dataptr);
+		break;
+
+	case TRACE_SEND_CPDU:
+		printf("sending C-PDU ct %02X ci %02X dl %u id %08X psz %u dptr %u\n",
+		       r->sdt, r->info, r->len, r->af, r->padsz, r->dataptr);
+		break;
+
+	case TRACE_SEND_MPDU:
+		printf("(%s) sending M-PDU vcid %02X tid %03X with length %u "
+		       "(fill %u%%)\n", tr->reason(r->info), r->sdt, r->prio,
+		       r->dataptr, r->fill);
+		break;
+	}
+}
+
+/* consumer thread */
+static inline void *trace_thread(void *arg)
+{
+	struct trace_ring *tr = arg;
+	struct canxl_frame *cfx = calloc(1, sizeof(*cfx));
+	unsigned int head;
+
+	if (!cfx)
+		return NULL;
+
+	while (1) {
+		head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+
+		if (tr->tail == head) {
+			if (__atomic_load_n(&tr->stop, __ATOMIC_ACQUIRE))
+				break;
+
+			fflush(stdout);
+			usleep(1000);
+			continue;
+		}
+
+		trace_format(tr, &tr->rec[tr->tail & (TRACE_RING_SIZE - 1)],
+			     cfx);
+
+		__atomic_store_n(&tr->tail, tr->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	if (tr->dropped)
+		printf("trace: %llu records dropped\n", tr->dropped);
+	fflush(stdout);
+	free(cfx);
+
+	return NULL;
+}
+
+static inline struct trace_ring *trace_start(unsigned int sample, char **names,
+					     const char *(*reason)(int))
+{
+	struct trace_ring *tr;
+	sigset_t all, old;
+	int ret;
+
+	if (posix_memalign((void **)&tr, 64, sizeof(*tr)))
+		return NULL;
+
+	memset(tr, 0, sizeof(*tr));
+	tr->sample = sample ? sample : 1;
+	tr->names = names;
+	tr->reason = reason;
+
+	tr->rec = calloc(TRACE_RING_SIZE, sizeof(struct trace_rec));
+	if (!tr->rec) {
+		free(tr);
+		return NULL;
+	}
+
+	/*
+	 * The signals are handled by the event loop (signalfd) - the thread
+	 * must not catch them with their default action whatever the caller
+	 * blocked so far.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&tr->thread, NULL, trace_thread, tr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		free(tr->rec);
+		free(tr);
+		return NULL;
+	}
+
+	return tr;
+}
+
+/* format all pending records and terminate the consumer thread */
+static inline void trace_stop(struct trace_ring *tr)
+{
+	__atomic_store_n(&tr->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(tr->thread, NULL);
+	free(tr->rec);
+	free(tr);
+}
+
+#endif /* TRACE_H */
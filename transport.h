@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * transport.h - CAN XL frame transport via CAN_RAW or AF_UNIX sockets
+ *
+ * Besides CAN interface names the tools accept
+ *   fd:<n>       an inherited AF_UNIX SOCK_SEQPACKET socket (socketpair)
+ *   unix:<path>  a connection to an AF_UNIX SOCK_SEQPACKET socket
+ * Each message carries one CAN XL frame (CAN XL header and data) like
+ * on a CAN_RAW socket. CAN filters and SIOCGSTAMP are CAN_RAW only.
+ *
+ * The socket buffer sizing, the kernel drop counter (SO_RXQ_OVFL) and
+ * SO_BUSY_POLL work for all socket types.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/types.h>
+#include <linux/sockios.h>
+
+#define TRANSPORT_FD "fd:"
+#define TRANSPORT_UNIX "unix:"
+#define TRANSPORT_BUSY_POLL_US 50 /* SO_BUSY_POLL time per receive syscall */
+
+/* length of the transport prefix (0 = CAN interface name) */
+static inline size_t transport_prefix(const char *name)
+{
+	if (!strncmp(name, TRANSPORT_FD, strlen(TRANSPORT_FD)))
+		return strlen(TRANSPORT_FD);
+
+	if (!strncmp(name, TRANSPORT_UNIX, strlen(TRANSPORT_UNIX)))
+		return strlen(TRANSPORT_UNIX);
+
+	return 0;
+}
+
+static inline int transport_is_can(const char *name)
+{
+	return !transport_prefix(name);
+}
+
+/* get the socket of a fd:<n> or unix:<path> transport */
+static inline int transport_open(const char *name)
+{
+	const char *addr = name + transport_prefix(name);
+	struct sockaddr_un un;
+	int s;
+
+	if (!strncmp(name, TRANSPORT_FD, strlen(TRANSPORT_FD)))
+		return atoi(addr);
+
+	if (strlen(addr) >= sizeof(un.sun_path)) {
+		fprintf(stderr, "transport path '%s' is too long!\n", addr);
+		return -1;
+	}
+
+	s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (s < 0) {
+		perror("transport socket");
+		return -1;
+	}
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strcpy(un.sun_path, addr);
+
+	if (connect(s, (struct sockaddr *)&un, sizeof(un)) < 0) {
+		perror("transport connect");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* reception time of the last frame (SIOCGSTAMP is CAN_RAW only) */
+static inline int transport_stamp(int s, const char *name, struct timeval *tv)
+{
+	if (!transport_is_can(name))
+		return gettimeofday(tv, NULL);
+
+	return ioctl(s, SIOCGSTAMP, tv);
+}
+
+/*
+ * Set the receive (rcv != 0) or send buffer size of the socket.
+ * SO_RCVBUFFORCE/SO_SNDBUFFORCE exceed the net.core.rmem_max/wmem_max
+ * limits when running with CAP_NET_ADMIN.
+ */
+static inline int transport_bufsize(int s, const char *name, int rcv,
+				    int size)
+{
+	int force = rcv ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+	int opt = rcv ? SO_RCVBUF : SO_SNDBUF;
+	socklen_t optlen = sizeof(int);
+	int val;
+
+	if (setsockopt(s, SOL_SOCKET, force, &size, sizeof(size)) < 0 &&
+	    setsockopt(s, SOL_SOCKET, opt, &size, sizeof(size)) < 0) {
+		perror(rcv ? "sockopt SO_RCVBUF" : "sockopt SO_SNDBUF");
+		return -1;
+	}
+
+	/* the kernel doubles the value for its bookkeeping overhead */
+	if (!getsockopt(s, SOL_SOCKET, opt, &val, &optlen) && val < 2 * size)
+		fprintf(stderr, "%s: %s buffer limited to %d bytes (see "
+			"net.core.%s)\n", name, rcv ? "receive" : "send",
+			val / 2, rcv ? "rmem_max" : "wmem_max");
+
+	return 0;
+}
+
+/*
+ * Software RX timestamps via SO_TIMESTAMPING (see dwelltime.h). AF_UNIX
+ * sockets only timestamp the messages with SO_TIMESTAMP enabled, which
+ * adds a struct timeval control message.
+ */
+static inline int transport_timestamps(int s, const char *name, int flags)
+{
+	int on = 1;
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)) < 0) {
+		perror("sockopt SO_TIMESTAMPING");
+		return -1;
+	}
+
+	if (!transport_is_can(name) &&
+	    setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0) {
+		perror("sockopt SO_TIMESTAMP");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Busy polling of the device queue in the receive syscalls (SO_BUSY_POLL).
+ * Only NAPI based network drivers support it - without that the socket is
+ * just spun by the tool. Values above net.core.busy_read need
+ * CAP_NET_ADMIN.
+ */
+static inline void transport_busy_poll(int s, const char *name)
+{
+	int usecs = TRANSPORT_BUSY_POLL_US;
+
+	if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+		fprintf(stderr, "%s: no SO_BUSY_POLL (%s) - spinning only\n",
+			name, strerror(errno));
+}
+
+/* enable the kernel drop counter in the control messages of recvmsg() */
+static inline int transport_drops_enable(int s)
+{
+	int on = 1;
+
+	if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+		perror("sockopt SO_RXQ_OVFL");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Frames dropped by the kernel (full socket receive queue) since the last
+ * call. *last keeps the counter of the socket from the SO_RXQ_OVFL control
+ * message - which is only present after the first drop.
+ */
+static inline __u32 transport_drops(struct msghdr *msg, __u32 *last)
+{
+	struct cmsghdr *cmsg;
+	__u32 cnt, delta;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&cnt, CMSG_DATA(cmsg), sizeof(cnt));
+			delta = cnt - *last;
+			*last = cnt;
+			return delta;
+		}
+	}
+
+	return 0;
+}
+
+#endif /* TRANSPORT_H */
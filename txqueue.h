@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * txqueue.h - non-blocking CAN XL frame transmission with a pending queue
+ *
+ * A full socket buffer (EAGAIN) or a full CAN interface TX queue (ENOBUFS)
+ * is no fatal error. The frames that can not be sent are kept in a bounded
+ * FIFO until the destination takes frames again. EAGAIN is resolved by
+ * waiting for POLLOUT. ENOBUFS is not signalled by POLLOUT on CAN_RAW
+ * sockets and is retried after TXQ_RETRY_NS.
+ */
+
+#ifndef TXQUEUE_H
+#define TXQUEUE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/types.h>
+#include <linux/can.h>
+
+#define TXQ_DEFAULT_SIZE 64 /* pending frames */
+#define TXQ_MAX_SIZE 4096
+#define TXQ_RETRY_NS 1000000ULL /* retry interval after ENOBUFS */
+
+struct txq {
+	struct canxl_frame *frame;
+	unsigned int size;
+	unsigned int head; /* free running indices */
+	unsigned int tail;
+	int err; /* errno of the last transient send failure */
+};
+
+static inline int txq_create(struct txq *q, unsigned int size)
+{
+	memset(q, 0, sizeof(*q));
+	q->frame = calloc(size, sizeof(*q->frame));
+	if (!q->frame)
+		return -1;
+
+	q->size = size;
+
+	return 0;
+}
+
+static inline unsigned int txq_len(struct txq *q)
+{
+	return q->head - q->tail;
+}
+
+static inline int txq_full(struct txq *q)
+{
+	return txq_len(q) >= q->size;
+}
+
+/* copy the frame to the end of the queue (the queue must not be full) */
+static inline void txq_push(struct txq *q, struct canxl_frame *cfx)
+{
+	memcpy(&q->frame[q->head++ % q->size], cfx, CANXL_HDR_SIZE + cfx->len);
+}
+
+static inline struct canxl_frame *txq_front(struct txq *q)
+{
+	return &q->frame[q->tail % q->size];
+}
+
+static inline void txq_pop(struct txq *q)
+{
+	q->tail++;
+}
+
+/* the destination can not take the frame right now */
+static inline int tx_transient(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+/* send without blocking: 1 = sent, 0 = transient failure (errno), -1 = error */
+static inline int tx_frame(int s, struct canxl_frame *cfx)
+{
+	int nbytes;
+
+	nbytes = send(s, cfx, CANXL_HDR_SIZE + cfx->len, MSG_DONTWAIT);
+	if (nbytes == CANXL_HDR_SIZE + cfx->len)
+		return 1;
+
+	if (nbytes < 0 && tx_transient(errno))
+		return 0;
+
+	if (nbytes >= 0)
+		errno = EMSGSIZE; /* short write */
+
+	return -1;
+}
+
+/* block until the destination may take frames after a transient failure */
+static inline void tx_wait(int s, int err)
+{
+	struct timespec ts = { 0, TXQ_RETRY_NS };
+	struct pollfd pfd = { .fd = s, .events = POLLOUT };
+
+	if (err == ENOBUFS)
+		nanosleep(&ts, NULL);
+	else
+		poll(&pfd, 1, -1);
+}
+
+#endif /* TXQUEUE_H */
@@ -0,0 +1,400 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * uring.h - minimal io_uring I/O engine via raw syscalls (no liburing)
+ *
+ * Frames are received with multishot IORING_OP_RECVMSG into a provided
+ * buffer ring and sent as a chain of linked IORING_OP_SEND requests from
+ * a struct txq. IORING_OP_TIMEOUT replaces the timerfd. A single
+ * io_uring_enter() submits all prepared requests and waits for the
+ * completions, so at high rates many frames share one syscall.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/types.h>
+#include <linux/time_types.h>
+#include <linux/io_uring.h>
+
+#include "txqueue.h"
+
+/* request type and index in the user_data of the SQE/CQE */
+#define URING_UD(type, idx) (((__u64)(type) << 32) | (idx))
+#define URING_UD_TYPE(ud) ((unsigned int)((ud) >> 32))
+#define URING_UD_IDX(ud) ((unsigned int)(ud))
+
+struct uring {
+	int fd;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sqe_tail; /* prepared SQEs up to here */
+	struct io_uring_sqe *sqes;
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	void *cq_map;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+
+	/* linked sends of a struct txq */
+	unsigned int tx_inflight;
+	int tx_blocked; /* ENOBUFS - resend after a delay */
+};
+
+/* provided buffer ring (one buffer per received message) */
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	__u8 *base;
+	unsigned int nbufs; /* power of 2 */
+	unsigned int size;
+	__u16 tail;
+};
+
+static inline int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	__u8 *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	/* only this thread uses the ring - no task work interrupts */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (u->fd < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(__u32);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = 0;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED) {
+		perror("io_uring mmap");
+		close(u->fd);
+		return -1;
+	}
+
+	u->cq_map = u->sq_map;
+	if (u->cq_size) {
+		u->cq_map = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd,
+				 IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED) {
+			perror("io_uring mmap");
+			close(u->fd);
+			return -1;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		perror("io_uring mmap");
+		close(u->fd);
+		return -1;
+	}
+
+	sq = u->sq_map;
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sqe_tail = *u->sq_tail;
+
+	cq = u->cq_map;
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static inline void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_size)
+		munmap(u->cq_map, u->cq_size);
+	munmap(u->sq_map, u->sq_size);
+	close(u->fd);
+}
+
+/* get a zeroed SQE (NULL = submission queue full) */
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    u->sq_entries)
+		return NULL;
+
+	idx = u->sqe_tail++ & *u->sq_mask;
+	u->sq_array[idx] = idx;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/* submit the prepared SQEs and wait for wait_nr completions */
+static inline int uring_submit(struct uring *u, unsigned int wait_nr)
+{
+	unsigned int n = u->sqe_tail - *u->sq_tail;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+	return syscall(__NR_io_uring_enter, u->fd, n, wait_nr,
+		       wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static inline struct io_uring_cqe *uring_peek(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* hand back a buffer to the kernel */
+static inline void uring_bufs_put(struct uring_bufs *b, __u16 bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nbufs - 1)];
+
+	buf->addr = (unsigned long)(b->base + bid * b->size);
+	buf->len = b->size;
+	buf->bid = bid;
+
+	b->tail++;
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+static inline int uring_bufs_init(struct uring *u, struct uring_bufs *b,
+				  __u16 bgid, unsigned int nbufs,
+				  unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	b->nbufs = nbufs;
+	b->size = size;
+	b->tail = 0;
+
+	b->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+		     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED) {
+		perror("buffer ring mmap");
+		return -1;
+	}
+
+	b->base = calloc(nbufs, size);
+	if (!b->base) {
+		perror("calloc");
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) < 0) {
+		perror("IORING_REGISTER_PBUF_RING");
+		return -1;
+	}
+
+	for (i = 0; i < nbufs; i++)
+		uring_bufs_put(b, i);
+
+	return 0;
+}
+
+/*
+ * Receive messages into buffers of the group bgid until the request
+ * terminates (no IORING_CQE_F_MORE). The msg_namelen and msg_controllen
+ * of msg define the buffer layout and msg has to stay valid.
+ */
+static inline void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe,
+						int s, struct msghdr *msg,
+						__u16 bgid, __u64 ud)
+{
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s;
+	sqe->addr = (unsigned long)msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bgid;
+	sqe->user_data = ud;
+}
+
+/*
+ * Get the payload of a multishot IORING_OP_RECVMSG completion in the
+ * buffer bid. The control messages are provided in *msg for the CMSG_*()
+ * macros.
+ */
+static inline void *uring_recvmsg(struct uring_bufs *b, __u16 bid,
+				  struct msghdr *tmpl, struct msghdr *msg,
+				  int *len)
+{
+	__u8 *buf = b->base + bid * b->size;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_control = buf + sizeof(*out) + tmpl->msg_namelen;
+	msg->msg_controllen = out->controllen;
+	msg->msg_flags = out->flags;
+	*len = out->payloadlen;
+
+	return buf + sizeof(*out) + tmpl->msg_namelen + tmpl->msg_controllen;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe *sqe, int s,
+				   void *buf, unsigned int len, __u64 ud)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = s;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->user_data = ud;
+}
+
+/* ts has to stay valid until the submission */
+static inline void uring_prep_timeout(struct io_uring_sqe *sqe,
+				      struct __kernel_timespec *ts,
+				      unsigned int flags, __u64 ud)
+{
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	sqe->timeout_flags = flags;
+	sqe->user_data = ud;
+}
+
+/* change the expiry of the timeout with timeout_ud (ts = NULL: remove) */
+static inline void uring_prep_timeout_update(struct io_uring_sqe *sqe,
+					     __u64 timeout_ud,
+					     struct __kernel_timespec *ts,
+					     unsigned int flags, __u64 ud)
+{
+	sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = timeout_ud;
+	if (ts) {
+		sqe->addr2 = (unsigned long)ts;
+		sqe->timeout_flags = flags | IORING_TIMEOUT_UPDATE;
+	}
+	sqe->user_data = ud;
+}
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+					     unsigned int events, __u64 ud)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = ud;
+}
+
+/*
+ * Submit the frames of the txq as one chain of linked sends. The link
+ * keeps the order of the frames, so a new chain is only started when the
+ * former chain has completed.
+ */
+static inline void uring_send_txq(struct uring *u, struct txq *q, int s,
+				  __u64 ud)
+{
+	struct io_uring_sqe *sqe, *last = NULL;
+	struct canxl_frame *cfx;
+	unsigned int i;
+
+	if (u->tx_inflight || u->tx_blocked)
+		return;
+
+	for (i = q->tail; i != q->head; i++) {
+		sqe = uring_get_sqe(u);
+		if (!sqe)
+			break;
+
+		cfx = &q->frame[i % q->size];
+		uring_prep_send(sqe, s, cfx, CANXL_HDR_SIZE + cfx->len, ud);
+		sqe->flags |= IOSQE_IO_LINK;
+		u->tx_inflight++;
+		last = sqe;
+	}
+
+	/* end of the chain */
+	if (last)
+		last->flags &= ~IOSQE_IO_LINK;
+}
+
+/*
+ * Completion of a linked send: 1 = frame sent, 0 = frame is sent again
+ * with the next chain (ENOBUFS sets tx_blocked), -1 = error (errno)
+ */
+static inline int uring_send_done(struct uring *u, struct txq *q,
+				  struct io_uring_cqe *cqe)
+{
+	u->tx_inflight--;
+
+	if (cqe->res >= 0) {
+		txq_pop(q);
+		return 1;
+	}
+
+	/* the rest of the chain is cancelled after a failed send */
+	if (cqe->res == -ECANCELED)
+		return 0;
+
+	if (tx_transient(-cqe->res)) {
+		u->tx_blocked = 1;
+		return 0;
+	}
+
+	errno = -cqe->res;
+	return -1;
+}
+
+#endif /* URING_H */